@@ -1,6 +1,6 @@
 /*
  * CSC 364 Assembler
- * Written by: John Hawkins 
+ * Written by: John Hawkins
  * 		 Date: 5/2/13
  * Compiles Assembly language from CSC 364 into machine code for emulator
  * Any comments, questions, concerns, suggestions or
@@ -9,619 +9,2037 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Total number of bytes that can be written
 #define ROM_SIZE 131068
+// Deepest chain of files including each other
+#define MAX_INCLUDE_DEPTH 64
+// Most threads parsing included files at once (asm16 -j)
+#define MAX_WORKERS 64
+// Start of every file in the build cache (asm16 -C), changed whenever struct Item is
+#define CACHE_MAGIC "ASM16U1"
+// First line of a debug map (asm16 -g), read by emu16 --map
+#define MAP_MAGIC "EMU16MAP1"
+// Most tokens kept for a single line, anything more is only counted
+#define MAX_TOKS 6
+
+// Command numbers above the 16 machine code opcodes
+#define COM_INCLUDE 16
+#define COM_INCLUDEBIN 17
+#define COM_JMP 18
+#define COM_JZ 19
+#define COM_JNZ 20
+#define COM_JP 21
+#define COM_JN 22
+#define COM_SCRATCH 23
+#define COM_LI 24
+
+// Kinds of items a source file is parsed into
+#define ITEM_INSN 0	// A machine code command
+#define ITEM_BYTES 1	// Raw machine code from includebin
+#define ITEM_LABEL 2	// A label definition, takes no space
+#define ITEM_JUMP 3	// A jump, sized once every label has an address (see relax())
+#define ITEM_INCLUDE 4	// An included file, replaced by its own items (see expand())
+#define ITEM_NONE 5	// Removed by optimize()
+#define ITEM_LOAD 6	// A constant load, replaced by machine code (see loadConstants())
+
+// Hand written commands writing the PC found by handJumps()
+#define JUMPS_NONE 0	// None, apart from halting
+#define JUMPS_RELATIVE 1	// Only ADDI / SUBI PC, PC and INCIZ / DECIN PC
+#define JUMPS_COMPUTED 2	// Addresses the program works out itself
+
+// How far checkIncludes() has got with a unit
+#define UNIT_UNCHECKED 0
+#define UNIT_CHECKING 1	// Its includes are being checked, so including it again is a cycle
+#define UNIT_CHECKED 2
+
+// Register long jumps load their target into, unless changed with scratch
+#define DEFAULT_SCRATCH 12
+
+// Object file (asm16 -c) magic number and section flags, shared with link16
+#define OBJ_MAGIC "O16"
+#define SEC_RUNS_ON 1	// The last command doesn't jump away, so the next section must follow
+#define SYM_GLOBAL 1	// Can be jumped to from other object files
+#define SYM_UNDEFINED 0xFFFF	// Section of a label defined in another object file
+
+// Operand formats of the machine code commands
+#define FMT_RR 0	// 2 Registers
+#define FMT_RRR 1	// 3 Registers
+#define FMT_RRC 2	// 2 Registers and a 4 bit Constant
+#define FMT_RC 3	// 1 Register and an 8 bit Constant
+#define FMT_RCR 4	// Register, 4 bit Constant and Register
+
+// A token is a slice of the source text, which is never copied or modified
+struct Token {
+	const char *str;
+	int len;
+};
+
+// A name in one of the perfect hash tables below
+struct Keyword {
+	const char *name;
+	int num;
+};
+
+// A single command, label or included file parsed from the source
+struct Item {
+	int kind;
+	int com, d, a, b;	// ITEM_INSN: command and operands, ITEM_JUMP: jump command
+	int sym;		// ITEM_LABEL: label defined, ITEM_JUMP: target label or -1
+	int target;		// ITEM_JUMP: target address when there is no target label
+	int cond;		// ITEM_JUMP: register tested by conditional jumps
+	int scratch;		// ITEM_JUMP: register long jumps load their target into
+	int value;		// ITEM_LOAD: 16 bit constant loaded into register d
+	unsigned char *bytes;	// ITEM_BYTES: machine code
+	struct Unit *unit;	// ITEM_INCLUDE: the included file
+	char *path;		// ITEM_INCLUDE / ITEM_BYTES: file name as written, for the build cache
+	int len;		// Number of bytes written to the rom
+	int addr;		// Byte offset in the rom (see relax())
+	const char *file;	// Source file (NULL for stdin) and line, for error messages
+	int line;
+	int keep;		// Never changed by optimize()
+	int section;		// Section of the object file (see splitSections())
+};
+
+// A long jump whose SET / SETH pair link16 fills in with the target's address
+struct Reloc {
+	int section;
+	int offset;	// Byte offset of the SET in the rom, relative to the section once written
+	int sym;
+};
+
+// A parsed source file. Labels are numbered within the file, so each copy of a
+// file that is included more than once gets labels of its own. Files are only
+// parsed once, later includes reuse the same unit.
+struct Unit {
+	char *path;
+	struct Item *items;
+	int numItems, maxItems;
+	char **syms;
+	int *symLines;	// Line each label is defined on, 0 until it is defined
+	int numSyms, maxSyms;
+	int *symSlots;	// Hash table of symbol numbers + 1 (0 is an empty slot), see findSym()
+	int numSlots;
+	int scratch;
+	struct Unit *next;
+	// Errors found while parsing, which may happen on another thread. They are
+	// printed in include order once every file is parsed (see checkIncludes()).
+	FILE *errs;
+	char *errBuf;
+	size_t errLen;
+	int numErrors;
+	int unreadable;	// The file couldn't be read
+	int state;	// UNIT_ constant
+};
+
+/*
+ * Command names, placed by hashName(name,1,5,9,128). The short 3 character
+ * commands and the long commands specified by professor in class both map
+ * to the same machine code number. Every name lands in its own slot, so a
+ * lookup is one hash and one string compare.
+ */
+const struct Keyword commands[128] = {
+	[10] = {"mvp",14},	[12] = {"movep",14},	[13] = {"include",COM_INCLUDE},
+	[33] = {"or",3},	[34] = {"orr",3},	[40] = {"move",0},
+	[41] = {"sub",5},	[44] = {"not",1},	[56] = {"li",COM_LI},
+	[57] = {"mov",0},	[58] = {"decin",11},	[59] = {"set",8},
+	[63] = {"inciz",10},	[77] = {"jnz",COM_JNZ},	[79] = {"scratch",COM_SCRATCH},
+	[80] = {"add",4},	[82] = {"mvx",13},	[84] = {"movex",13},
+	[85] = {"sbi",7},	[86] = {"subi",7},	[87] = {"dec",11},
+	[88] = {"jz",COM_JZ},	[89] = {"includebin",COM_INCLUDEBIN},	[90] = {"and",2},
+	[94] = {"sth",9},	[95] = {"seth",9},	[96] = {"jn",COM_JN},
+	[100] = {"mvz",12},	[102] = {"movez",12},	[114] = {"jmp",COM_JMP},
+	[116] = {"jp",COM_JP},	[120] = {"mvn",15},	[121] = {"inc",10},
+	[122] = {"moven",15},	[125] = {"adi",6},	[126] = {"addi",6}
+};
+
+/*
+ * Register names and macros, placed by hashName(name,5,6,12,64).
+ * Registers can be given in hexadecimal (r0 - rF) or decimal (r0 - r15).
+ * PC is the program counter, OUT0 / OUT1 the output registers and IN the input register.
+ */
+const struct Keyword registers[64] = {
+	[0] = {"r2",2},	[1] = {"r7",7},	[4] = {"r12",12},	[10] = {"rd",13},
+	[13] = {"r3",3},	[14] = {"r8",8},	[16] = {"r13",13},	[22] = {"in",6},
+	[23] = {"re",14},	[26] = {"r4",4},	[27] = {"r9",9},	[28] = {"r14",14},
+	[34] = {"out0",13},	[35] = {"ra",10},	[36] = {"rf",15},	[38] = {"r0",0},
+	[39] = {"r5",5},	[40] = {"r15",15},	[44] = {"r10",10},	[45] = {"output0",13},
+	[46] = {"out1",14},	[47] = {"input",6},	[48] = {"rb",11},	[49] = {"pc",15},
+	[51] = {"r1",1},	[52] = {"r6",6},	[56] = {"r11",11},	[57] = {"output1",14},
+	[61] = {"rc",12}
+};
+
+// Operand format, name (for error messages) of each machine code command
+const int comFormats[16] = {
+	FMT_RR, FMT_RR, FMT_RRR, FMT_RRR,
+	FMT_RRR, FMT_RRR, FMT_RRC, FMT_RRC,
+	FMT_RC, FMT_RC, FMT_RCR, FMT_RCR,
+	FMT_RRR, FMT_RRR, FMT_RRR, FMT_RRR
+};
+const char *comNames[16] = {
+	"MOVE (MOV)", "NOT", "AND", "OR (ORR)",
+	"ADD", "SUB", "ADDI (ADI)", "SUBI (SBI)",
+	"SET", "SETH (STH)", "INCIZ (INC)", "DECIN (DEC)",
+	"MOVEZ (MVZ)", "MOVEX (MVX)", "MOVEP (MVP)", "MOVEN (MVN)"
+};
+// Number of arguments and their description for each operand format
+const int fmtArgs[5] = { 2, 3, 3, 2, 3 };
+const char *fmtDescs[5] = {
+	"2 Registers", "3 Registers", "2 Registers and a Constant",
+	"1 Register and 1 Constant", "2 Registers and a Constant"
+};
+// Names of the jump commands and the conditional move each one's long form ends with
+const char *jumpNames[5] = { "JMP", "JZ", "JNZ", "JP", "JN" };
+const int jumpMoves[5] = { 0, 12, 13, 14, 15 };
 
 // Function prototypes
-int getComNum(char*);
-int getRegNum(char*);
-int getNormNum(char*);
+struct Unit *newUnit(char*);
+void parseAll(struct Unit*,const char*,size_t);
+void *parseWorker(void*);
+void parseFile(struct Unit*);
+void parseUnit(struct Unit*,const char*,size_t);
+void checkIncludes(struct Unit*,int);
+unsigned long long hashSource(const char*,size_t);
+int loadUnit(struct Unit*,unsigned long long);
+void saveUnit(struct Unit*,unsigned long long);
+void assemble(struct Unit*,const char*,size_t);
+void parseLine(struct Unit*,struct Token*,int,int);
+struct Item *addItem(struct Unit*,int,int);
+void defineLabel(struct Unit*,struct Token*,int);
+int findSym(struct Unit*,struct Token*);
+void placeSym(struct Unit*,int);
+unsigned hashSym(const char*,int);
+void encode(struct Unit*,int,struct Token*,int,int);
+void parseJump(struct Unit*,int,struct Token*,int,int);
+void parseLoad(struct Unit*,struct Token*,int,int);
+void includeFile(struct Unit*,struct Token*,int);
+void includeBin(struct Unit*,struct Token*,int);
+void checkLabels(struct Unit*);
+void expand(struct Unit*);
+void splitSections();
+void checkSections();
+int spanSection(int,int);
+void loadConstants();
+int pickLoad(struct Item*,int*,struct Item*);
+void trackConstants(struct Item*,int*);
+void optimize();
+int handJumps(int);
+int isHalt(int*);
+void protectSpan(int,int);
+int isNop(struct Item*);
+void relax();
+int jumpSize(struct Item*);
+void emit();
+void emitJump(struct Item*);
+void writeMap(const char*);
+void writeObject();
+int runsOn(struct Item*);
+void writeNum(int);
+char *loadSource(int,size_t*,int*);
+void freeSource(char*,size_t,int);
+void asmError(int,const char*,...);
+void itemError(struct Item*,const char*,...);
+void vError(const char*,int,const char*,va_list);
+int hashName(struct Token*,int,int,int,int);
+int getComNum(struct Token*);
+int getRegNum(struct Token*);
+int getNormNum(struct Token*);
+
+// rom is the total memory to be used by the emulator
+unsigned char rom[ROM_SIZE];
+int romIndex = 0, err = 0;
+// Every file included so far, and the ones still waiting to be parsed by
+// parseWorker(). All of these are only used while holding parseLock.
+struct Unit *unitCache = NULL;
+struct Unit **parseQueue = NULL;
+int queueHead = 0, queueTail = 0, maxQueue = 0, busyWorkers = 0;
+pthread_mutex_t parseLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parseCond = PTHREAD_COND_INITIALIZER;
+// Number of threads parsing files (0 for one per core), the build cache directory
+// (NULL if not used), and how many files were parsed and found in it
+int numWorkers = 0;
+const char *cacheDir = NULL;
+int cacheFiles = 0, cacheHits = 0;
+// The unit each thread is parsing, errors are kept with it (see vError())
+__thread struct Unit *curUnit = NULL;
+// Every item of the program with all includes expanded, and the labels they use
+struct Item *prog = NULL;
+int numProg = 0, maxProg = 0;
+char **symNames = NULL;
+int *symAddrs = NULL;
+int numSyms = 0, maxSyms = 0;
+// Object file mode (asm16 -c), the labels of the main file (which are its symbols),
+// each label's section (-1 if undefined), where each section starts and the relocations
+int objMode = 0, rootSyms = 0;
+int *symSections = NULL;
+int numSections = 1;
+struct Reloc *relocs = NULL;
+int numRelocs = 0, maxRelocs = 0;
+// Number of times each peephole optimization was applied
+int optMoves = 0, optInputs = 0, optSets = 0, optAdds = 0;
+
+/*
+ * Main function. The total parsing of the assembly code is converted to machine code
+ * for the emulator. Input is read from stdin and output is printed to stdout. Piping
+ * is recommended. Any and all problems with the inputted code are printed at the end of the
+ * process before printing the resulting code to stderr.
+ * The -O flag runs the peephole optimizer before the machine code is written.
+ * The -c flag writes a relocatable object file for link16 instead of a rom.
+ * Included files are parsed on one thread per core (-j sets the number), and -C keeps
+ * every parsed file in a build cache directory so unchanged files are never parsed again.
+ * The -g flag writes a debug map of the source line of every ROM address for emu16.
+ * Exits with 1 if any errors were found.
+ */
+int main(int argc,char **argv)
+{
+	int opt = 0, i;
+	const char *mapPath = NULL;
+	for(i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-O")) {
+			opt = 1;
+		}else if(!strcmp(argv[i],"-c")) {
+			objMode = 1;
+		}else if(!strcmp(argv[i],"-j") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			numWorkers = atoi(argv[++i]);
+		}else if(!strcmp(argv[i],"-C") && i + 1 < argc) {
+			cacheDir = argv[++i];
+		}else if(!strcmp(argv[i],"-g") && i + 1 < argc) {
+			mapPath = argv[++i];
+		}else {
+			fprintf(stderr,"Usage: asm16 [-O] [-c] [-j threads] [-C cachedir] [-g mapfile] < input > output\n");
+			fprintf(stderr,"\t -O : Optional peephole optimization\n");
+			fprintf(stderr,"\t -c : Write a relocatable object file for link16\n");
+			fprintf(stderr,"\t -j : Number of threads parsing included files (one per core by default)\n");
+			fprintf(stderr,"\t -C : Keep parsed files in cachedir, and reuse them while they are unchanged\n");
+			fprintf(stderr,"\t -g : Write the source line of every ROM address to mapfile (not with -c)\n");
+			return 1;
+		}
+	}
+	// Addresses in an object file change when it is linked
+	if(mapPath != NULL && objMode) {
+		fprintf(stderr,"Assembler Error: -g can't be used with -c\n");
+		return 1;
+	}
+	size_t len;
+	int mapped;
+	char *src = loadSource(STDIN_FILENO,&len,&mapped);
+	if(src == NULL) {
+		fprintf(stderr,"Assembler Error: Unable to read input\n");
+		return 1;
+	}
+	struct Unit *root = newUnit(NULL);
+	parseAll(root,src,len);
+	freeSource(src,len,mapped);
+	// Once every file is parsed, give each label an address and write the machine code
+	if(!err) {
+		expand(root);
+		rootSyms = root->numSyms;
+		splitSections();
+		loadConstants();
+		if(objMode) {
+			checkSections();
+		}
+		if(opt) {
+			optimize();
+		}
+		relax();
+		emit();
+	}
+	// If no errors were found, the rom data can be printed to stdout.
+	if(!err && mapPath != NULL) {
+		writeMap(mapPath);
+	}
+	if(!err && objMode) {
+		writeObject();
+	}else if(!err) {
+		fprintf(stderr,"Total Bytes Written: %d\n",romIndex);
+		fwrite(rom,sizeof(char),romIndex,stdout);
+	}
+	return err ? 1 : 0;
+}
+
+/*
+ * Allocates an empty unit for the source file at path.
+ */
+struct Unit *newUnit(char *path)
+{
+	struct Unit *unit = calloc(1,sizeof(struct Unit));
+	unit->path = path;
+	unit->scratch = DEFAULT_SCRATCH;
+	return unit;
+}
+
+/*
+ * Parses the main file into root, and every file it includes into units of their
+ * own. Included files are queued as they are found (see includeFile()) and parsed
+ * by a pool of threads, so whole include trees are parsed side by side. Once every
+ * file is parsed, the errors are printed and include cycles are checked.
+ */
+void parseAll(struct Unit *root,const char *src,size_t len)
+{
+	pthread_t threads[MAX_WORKERS];
+	int i, n = numWorkers ? numWorkers : sysconf(_SC_NPROCESSORS_ONLN);
+	n = (n < 1) ? 1 : (n > MAX_WORKERS) ? MAX_WORKERS : n;
+	parseUnit(root,src,len);
+	// Only start threads if there are files to parse. Even a single include can include
+	// many more, and idle threads wait on parseCond for them.
+	if(n == 1 || queueTail == 0) {
+		parseWorker(NULL);
+	}else {
+		for(i=0;i<n;i++) {
+			if(pthread_create(&threads[i],NULL,parseWorker,NULL)) {
+				break;
+			}
+		}
+		n = i;
+		parseWorker(NULL);
+		for(i=0;i<n;i++) {
+			pthread_join(threads[i],NULL);
+		}
+	}
+	checkIncludes(root,0);
+	if(cacheDir != NULL) {
+		fprintf(stderr,"Build Cache: %d of %d files unchanged\n",cacheHits,cacheFiles);
+	}
+}
+
+/*
+ * Parses queued files until there are none left and no other thread is parsing
+ * a file that could include more.
+ */
+void *parseWorker(void *arg)
+{
+	pthread_mutex_lock(&parseLock);
+	for(;;) {
+		if(queueHead < queueTail) {
+			struct Unit *unit = parseQueue[queueHead++];
+			busyWorkers++;
+			pthread_mutex_unlock(&parseLock);
+			parseFile(unit);
+			pthread_mutex_lock(&parseLock);
+			busyWorkers--;
+			pthread_cond_broadcast(&parseCond);
+		}else if(busyWorkers == 0) {
+			break;
+		}else {
+			pthread_cond_wait(&parseCond,&parseLock);
+		}
+	}
+	pthread_mutex_unlock(&parseLock);
+	return arg;
+}
+
+/*
+ * Reads and parses an included file into its unit. If it can't be read, each
+ * include of it reports the error (see checkIncludes()).
+ */
+void parseFile(struct Unit *unit)
+{
+	int fd = open(unit->path,O_RDONLY);
+	size_t len;
+	int mapped;
+	char *src = (fd < 0) ? NULL : loadSource(fd,&len,&mapped);
+	if(fd >= 0) {
+		close(fd);
+	}
+	if(src == NULL) {
+		unit->unreadable = 1;
+		return;
+	}
+	parseUnit(unit,src,len);
+	freeSource(src,len,mapped);
+}
+
+/*
+ * Parses the source of a file into the unit, or loads it from the build cache if
+ * the same source was parsed before. Errors are kept with the unit.
+ */
+void parseUnit(struct Unit *unit,const char *src,size_t len)
+{
+	unsigned long long key = 0;
+	curUnit = unit;
+	unit->errs = open_memstream(&unit->errBuf,&unit->errLen);
+	if(cacheDir != NULL) {
+		key = hashSource(src,len);
+	}
+	int hit = cacheDir != NULL && loadUnit(unit,key);
+	if(!hit) {
+		assemble(unit,src,len);
+		if(cacheDir != NULL && !unit->numErrors) {
+			saveUnit(unit,key);
+		}
+	}
+	checkLabels(unit);
+	fclose(unit->errs);
+	unit->errs = NULL;
+	curUnit = NULL;
+	pthread_mutex_lock(&parseLock);
+	cacheFiles++;
+	cacheHits += hit;
+	pthread_mutex_unlock(&parseLock);
+}
+
+/*
+ * Prints the errors found in the unit and the files it includes, in the order
+ * they are included, and counts them. Also reports includes of files that
+ * can't be read, include cycles and includes nested too deeply.
+ */
+void checkIncludes(struct Unit *unit,int depth)
+{
+	int i;
+	unit->state = UNIT_CHECKING;
+	fwrite(unit->errBuf,1,unit->errLen,stderr);
+	err += unit->numErrors;
+	for(i=0;i<unit->numItems;i++) {
+		struct Item *item = &unit->items[i];
+		if(item->kind != ITEM_INCLUDE) {
+			continue;
+		}
+		struct Unit *inc = item->unit;
+		if(inc->unreadable) {
+			itemError(item,"Assembler Error: File pointer \'%s\' not valid",item->path);
+		}else if(inc->state == UNIT_CHECKING) {
+			itemError(item,"Assembler Error: Include cycle, \'%s\' is already being assembled",item->path);
+		}else if(inc->state == UNIT_UNCHECKED && depth >= MAX_INCLUDE_DEPTH) {
+			itemError(item,"Assembler Error: Includes nested too deeply at \'%s\'",item->path);
+		}else if(inc->state == UNIT_UNCHECKED) {
+			checkIncludes(inc,depth + 1);
+		}
+	}
+	unit->state = UNIT_CHECKED;
+}
+
+/*
+ * Hashes source code with 64 bit FNV-1a, starting from the cache format so that
+ * files cached by an older asm16 are never used.
+ *
+ * Returns: The hash, which names the file in the build cache
+ */
+unsigned long long hashSource(const char *src,size_t len)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	const char *magic = CACHE_MAGIC;
+	size_t i;
+	for(i=0;magic[i];i++) {
+		hash = (hash ^ (unsigned char) magic[i]) * 1099511628211ULL;
+	}
+	for(i=0;i<len;i++) {
+		hash = (hash ^ (unsigned char) src[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Loads the unit parsed from source with hash key from the build cache. Included
+ * files are looked up and includebin files read again, as if the include
+ * statements were parsed, so only the file itself needs to be unchanged.
+ *
+ * Returns: 1 if the unit was in the cache, otherwise 0
+ */
+int loadUnit(struct Unit *unit,unsigned long long key)
+{
+	char path[PATH_MAX], magic[sizeof(CACHE_MAGIC)], name[PATH_MAX];
+	int i, n, fields[12];
+	snprintf(path,sizeof(path),"%s/%016llx",cacheDir,key);
+	FILE *fp = fopen(path,"rb");
+	if(fp == NULL) {
+		return 0;
+	}
+	if(fread(magic,1,sizeof(magic),fp) != sizeof(magic) || memcmp(magic,CACHE_MAGIC,sizeof(magic))
+		|| fread(&n,sizeof(int),1,fp) != 1) {
+		fclose(fp);
+		return 0;
+	}
+	for(i=0;i<n;i++) {
+		int len, line;
+		if(fread(&len,sizeof(int),1,fp) != 1 || len < 0 || len >= PATH_MAX || fread(name,1,len,fp) != (size_t) len
+			|| fread(&line,sizeof(int),1,fp) != 1) {
+			break;
+		}
+		struct Token tok = { name, len };
+		int sym = findSym(unit,&tok);
+		unit->symLines[sym] = line;
+	}
+	int ok = i == n && fread(&n,sizeof(int),1,fp) == 1;
+	for(i=0;ok && i<n && fread(fields,sizeof(int),12,fp) == 12;i++) {
+		int len = 0;
+		if(fields[0] == ITEM_INCLUDE || fields[0] == ITEM_BYTES) {
+			if(fread(&len,sizeof(int),1,fp) != 1 || len <= 0 || len >= PATH_MAX || fread(name,1,len,fp) != (size_t) len) {
+				break;
+			}
+			struct Token tok = { name, len };
+			if(fields[0] == ITEM_INCLUDE) {
+				includeFile(unit,&tok,fields[11]);
+			}else {
+				includeBin(unit,&tok,fields[11]);
+			}
+			continue;
+		}
+		struct Item *item = addItem(unit,fields[0],fields[11]);
+		item->com = fields[1];
+		item->d = fields[2];
+		item->a = fields[3];
+		item->b = fields[4];
+		item->sym = fields[5];
+		item->target = fields[6];
+		item->cond = fields[7];
+		item->scratch = fields[8];
+		item->value = fields[9];
+		item->len = fields[10];
+	}
+	fclose(fp);
+	// A damaged file is parsed again from the start
+	if(!ok || i < n) {
+		unit->numItems = unit->numSyms = unit->numErrors = 0;
+		memset(unit->symSlots,0,unit->numSlots * sizeof(int));
+		rewind(unit->errs);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Saves the unit parsed from source with hash key to the build cache. The file is
+ * written under a temporary name first, so other builds never read half of it.
+ */
+void saveUnit(struct Unit *unit,unsigned long long key)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int i;
+	mkdir(cacheDir,0777);
+	snprintf(path,sizeof(path),"%s/%016llx",cacheDir,key);
+	snprintf(tmp,sizeof(tmp),"%s.%d.%p",path,(int) getpid(),(void*) unit);
+	FILE *fp = fopen(tmp,"wb");
+	if(fp == NULL) {
+		return;
+	}
+	fwrite(CACHE_MAGIC,1,sizeof(CACHE_MAGIC),fp);
+	fwrite(&unit->numSyms,sizeof(int),1,fp);
+	for(i=0;i<unit->numSyms;i++) {
+		int len = strlen(unit->syms[i]);
+		fwrite(&len,sizeof(int),1,fp);
+		fwrite(unit->syms[i],1,len,fp);
+		fwrite(&unit->symLines[i],sizeof(int),1,fp);
+	}
+	fwrite(&unit->numItems,sizeof(int),1,fp);
+	for(i=0;i<unit->numItems;i++) {
+		struct Item *item = &unit->items[i];
+		int fields[12] = { item->kind, item->com, item->d, item->a, item->b, item->sym,
+			item->target, item->cond, item->scratch, item->value, item->len, item->line };
+		fwrite(fields,sizeof(int),12,fp);
+		if(item->kind == ITEM_INCLUDE || item->kind == ITEM_BYTES) {
+			int len = strlen(item->path);
+			fwrite(&len,sizeof(int),1,fp);
+			fwrite(item->path,1,len,fp);
+		}
+	}
+	if(fclose(fp) || rename(tmp,path)) {
+		unlink(tmp);
+	}
+}
+
+/*
+ * Parses all of the source code into the unit's items.
+ * The source is split into lines and tokens in a single pass, without copying it.
+ * Included files are queued to be parsed separately (see includeFile()).
+ */
+void assemble(struct Unit *unit,const char *src,size_t len)
+{
+	const char *p = src, *end = src + len;
+	struct Token toks[MAX_TOKS];
+	int lineNum = 0;
+	while(p < end) {
+		lineNum++;
+		int tokSize = 0;
+		// Tokens are separated by spaces, tabs and commas, up to the end of line or a comment
+		while(p < end && *p != '\n') {
+			char c = *p;
+			if(c == ' ' || c == '\t' || c == ',' || c == '\r') {
+				p++;
+			}else if(c == '#') {
+				while(p < end && *p != '\n') {
+					p++;
+				}
+			}else {
+				const char *start = p;
+				while(p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != '\r' && *p != '\n' && *p != '#') {
+					p++;
+				}
+				if(tokSize < MAX_TOKS) {
+					toks[tokSize].str = start;
+					toks[tokSize].len = p - start;
+				}
+				tokSize++;
+			}
+		}
+		p++;
+		if(tokSize > 0) {
+			parseLine(unit,toks,tokSize,lineNum);
+		}
+	}
+}
+
+/*
+ * Parses a single line of tokens into the unit, starting with an optional label.
+ */
+void parseLine(struct Unit *unit,struct Token *toks,int tokSize,int lineNum)
+{
+	if(toks[0].str[toks[0].len - 1] == ':') {
+		defineLabel(unit,&toks[0],lineNum);
+		toks++;
+		if(--tokSize == 0) {
+			return;
+		}
+	}
+	int com = getComNum(&toks[0]);
+	switch(com) {
+
+	// Check for include statement to import existing code
+	case COM_INCLUDE:
+		if(tokSize < 2) {
+			asmError(lineNum,"Assembler Error: include statement requires file pointer");
+		}else {
+			includeFile(unit,&toks[1],lineNum);
+		}
+		break;
+
+	// Check for includebin statement to import existing binary machine code
+	case COM_INCLUDEBIN:
+		if(tokSize < 2) {
+			asmError(lineNum,"Assembler Error: includebin statement requires file pointer");
+		}else {
+			includeBin(unit,&toks[1],lineNum);
+		}
+		break;
+
+	case COM_JMP:
+	case COM_JZ:
+	case COM_JNZ:
+	case COM_JP:
+	case COM_JN:
+		parseJump(unit,com,toks,tokSize,lineNum);
+		break;
+
+	case COM_LI:
+		parseLoad(unit,toks,tokSize,lineNum);
+		break;
+
+	// Change the register long jumps in the rest of the file load their target into
+	case COM_SCRATCH:
+		if(tokSize != 2 || (com = getRegNum(&toks[1])) < 0 || com == 6 || com > 12) {
+			asmError(lineNum,"Syntax Error: SCRATCH command takes 1 Register (not IN, OUT0, OUT1 or PC)");
+		}else {
+			unit->scratch = com;
+		}
+		break;
+
+	case -1: // ERROR
+		asmError(lineNum,"Unrecognized Command: \'%.*s\'",toks[0].len,toks[0].str);
+		break;
+
+	default:
+		encode(unit,com,toks,tokSize,lineNum);
+		break;
+	}
+}
+
+/*
+ * Adds a new item of the given kind to the end of the unit.
+ *
+ * Returns: The item, with every other field cleared
+ */
+struct Item *addItem(struct Unit *unit,int kind,int lineNum)
+{
+	if(unit->numItems == unit->maxItems) {
+		unit->maxItems = unit->maxItems ? unit->maxItems * 2 : 64;
+		unit->items = realloc(unit->items,unit->maxItems * sizeof(struct Item));
+	}
+	struct Item *item = &unit->items[unit->numItems++];
+	memset(item,0,sizeof(struct Item));
+	item->kind = kind;
+	item->file = unit->path;
+	item->line = lineNum;
+	return item;
+}
+
+/*
+ * Defines the label in tok (the name followed by a colon) at the current position.
+ * Names start with a letter, underscore or period, followed by any of those or digits,
+ * and can't be a number (like b1 or xface, see getNormNum()).
+ */
+void defineLabel(struct Unit *unit,struct Token *tok,int lineNum)
+{
+	struct Token name = { tok->str, tok->len - 1 };
+	int i, valid = name.len > 0 && (isalpha(name.str[0]) || name.str[0] == '_' || name.str[0] == '.');
+	for(i=1;i<name.len;i++) {
+		valid = valid && (isalnum(name.str[i]) || name.str[i] == '_' || name.str[i] == '.');
+	}
+	if(!valid) {
+		asmError(lineNum,"Syntax Error: Invalid label \'%.*s\'",tok->len,tok->str);
+		return;
+	}
+	// Jump targets are read as numbers first, so jumping to this label would go to an address
+	if(getNormNum(&name) >= 0) {
+		asmError(lineNum,"Syntax Error: Label \'%.*s\' reads as a number",name.len,name.str);
+		return;
+	}
+	int sym = findSym(unit,&name);
+	if(unit->symLines[sym]) {
+		asmError(lineNum,"Syntax Error: Label \'%s\' already defined on line %d",unit->syms[sym],unit->symLines[sym]);
+		return;
+	}
+	unit->symLines[sym] = lineNum;
+	addItem(unit,ITEM_LABEL,lineNum)->sym = sym;
+}
+
+/*
+ * Finds the label named by tok in the unit's hash table, adding it if it isn't
+ * there yet. Slots are probed one after another from the label's hash.
+ *
+ * Returns: The number of the label within the unit
+ */
+int findSym(struct Unit *unit,struct Token *tok)
+{
+	int i;
+	unsigned hash = hashSym(tok->str,tok->len);
+	for(i=hash & (unit->numSlots - 1);unit->numSlots && unit->symSlots[i];i=(i + 1) & (unit->numSlots - 1)) {
+		const char *sym = unit->syms[unit->symSlots[i] - 1];
+		if(!strncmp(sym,tok->str,tok->len) && sym[tok->len] == '\0') {
+			return unit->symSlots[i] - 1;
+		}
+	}
+	if(unit->numSyms == unit->maxSyms) {
+		unit->maxSyms = unit->maxSyms ? unit->maxSyms * 2 : 16;
+		unit->syms = realloc(unit->syms,unit->maxSyms * sizeof(char*));
+		unit->symLines = realloc(unit->symLines,unit->maxSyms * sizeof(int));
+	}
+	unit->syms[unit->numSyms] = strndup(tok->str,tok->len);
+	unit->symLines[unit->numSyms] = 0;
+	unit->numSyms++;
+	// The table is kept at most half full, so probes stay short
+	if(unit->numSyms * 2 > unit->numSlots) {
+		unit->numSlots = unit->numSlots ? unit->numSlots * 2 : 32;
+		free(unit->symSlots);
+		unit->symSlots = calloc(unit->numSlots,sizeof(int));
+		for(i=0;i<unit->numSyms;i++) {
+			placeSym(unit,i);
+		}
+	}else {
+		placeSym(unit,unit->numSyms - 1);
+	}
+	return unit->numSyms - 1;
+}
+
+/*
+ * Puts symbol number sym into the first empty slot of the unit's hash table.
+ */
+void placeSym(struct Unit *unit,int sym)
+{
+	int i = hashSym(unit->syms[sym],strlen(unit->syms[sym])) & (unit->numSlots - 1);
+	while(unit->symSlots[i]) {
+		i = (i + 1) & (unit->numSlots - 1);
+	}
+	unit->symSlots[i] = sym + 1;
+}
+
+/*
+ * Hashes a label name with 32 bit FNV-1a. Labels are case sensitive, unlike
+ * command and register names (see hashName()).
+ *
+ * Returns: The hash, reduced to a slot of the symbol table by the caller
+ */
+unsigned hashSym(const char *str,int len)
+{
+	unsigned hash = 2166136261U;
+	int i;
+	for(i=0;i<len;i++) {
+		hash = (hash ^ (unsigned char) str[i]) * 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Parses the machine code command com with the operands in toks[1..] into the unit.
+ */
+void encode(struct Unit *unit,int com,struct Token *toks,int tokSize,int lineNum)
+{
+	int fmt = comFormats[com];
+	if(tokSize != fmtArgs[fmt] + 1) {
+		asmError(lineNum,"Syntax Error: %s command takes %d arguments",comNames[com],fmtArgs[fmt]);
+		return;
+	}
+	int d = getRegNum(&toks[1]);
+	int a, b, c;
+	switch(fmt) {
+
+	case FMT_RR:
+		a = getRegNum(&toks[2]);
+		b = 0;
+		break;
+
+	case FMT_RRR:
+		a = getRegNum(&toks[2]);
+		b = getRegNum(&toks[3]);
+		break;
+
+	case FMT_RRC:
+		a = getRegNum(&toks[2]);
+		b = getNormNum(&toks[3]);
+		b = (b > 15) ? -1 : b;
+		break;
+
+	case FMT_RC:
+		c = getNormNum(&toks[2]);
+		a = (c > 255) ? -1 : (c >> 4);
+		b = c & 0xF;
+		break;
+
+	default: // FMT_RCR
+		a = getNormNum(&toks[2]);
+		a = (a > 15) ? -1 : a;
+		b = getRegNum(&toks[3]);
+		break;
+	}
+	if(d < 0 || a < 0 || b < 0) {
+		asmError(lineNum,"Syntax Error: %s command takes %s",comNames[com],fmtDescs[fmt]);
+		return;
+	}
+	struct Item *item = addItem(unit,ITEM_INSN,lineNum);
+	item->com = com;
+	item->d = d;
+	item->a = a;
+	item->b = b;
+	item->len = 2;
+}
+
+/*
+ * Parses a jump command. The target is a label or a ROM address, and conditional
+ * jumps also take the register to test:
+ * 	jmp target     : always jump
+ * 	jz target, rX  : jump if rX is zero
+ * 	jnz target, rX : jump if rX is not zero
+ * 	jp target, rX  : jump if rX is positive or zero
+ * 	jn target, rX  : jump if rX is negative
+ * The machine code used depends on how far the jump goes (see jumpSize()).
+ */
+void parseJump(struct Unit *unit,int com,struct Token *toks,int tokSize,int lineNum)
+{
+	const char *name = jumpNames[com - COM_JMP];
+	int cond = -1;
+	if(com == COM_JMP) {
+		if(tokSize != 2) {
+			asmError(lineNum,"Syntax Error: %s command takes 1 Label",name);
+			return;
+		}
+	}else {
+		if(tokSize != 3 || (cond = getRegNum(&toks[2])) < 0) {
+			asmError(lineNum,"Syntax Error: %s command takes 1 Label and 1 Register",name);
+			return;
+		}
+		if(cond == unit->scratch) {
+			asmError(lineNum,"Syntax Error: %s command can't test the scratch register r%d",name,cond);
+			return;
+		}
+	}
+	struct Item *item = addItem(unit,ITEM_JUMP,lineNum);
+	item->com = com;
+	item->cond = cond;
+	item->scratch = unit->scratch;
+	item->target = getNormNum(&toks[1]);
+	if(item->target < 0) {
+		item->sym = findSym(unit,&toks[1]);
+	}else if(item->target >= ROM_SIZE / 2) {
+		asmError(lineNum,"Syntax Error: %s target is past the end of the ROM",name);
+	}else {
+		item->sym = -1;
+	}
+}
+
+/*
+ * Parses a constant load, li rX, value. The value is 16 bits, given as a number
+ * (see getNormNum()) or a negative number. The machine code used depends on the
+ * commands before it (see loadConstants()).
+ */
+void parseLoad(struct Unit *unit,struct Token *toks,int tokSize,int lineNum)
+{
+	int d = (tokSize == 3) ? getRegNum(&toks[1]) : -1;
+	if(d < 0 || d == 6 || d == 15) {
+		asmError(lineNum,"Syntax Error: LI command takes 1 Register (not IN or PC) and 1 Constant");
+		return;
+	}
+	struct Token num = toks[2];
+	int neg = num.str[0] == '-';
+	if(neg) {
+		num.str++;
+		num.len--;
+	}
+	int value = (num.len > 0) ? getNormNum(&num) : -1;
+	if(value < 0 || value > (neg ? 32768 : 65535)) {
+		asmError(lineNum,"Syntax Error: LI constant \'%.*s\' is not a 16 bit number",toks[2].len,toks[2].str);
+		return;
+	}
+	struct Item *item = addItem(unit,ITEM_LOAD,lineNum);
+	item->d = d;
+	item->value = (neg ? -value : value) & 0xFFFF;
+}
+
+/*
+ * Adds the file named by tok to the unit, as if its code was written in place of
+ * the include statement on line lineNum. Each file is only parsed once, later
+ * includes reuse the same unit. New files are queued to be parsed (see parseAll()).
+ */
+void includeFile(struct Unit *unit,struct Token *tok,int lineNum)
+{
+	char path[PATH_MAX];
+	snprintf(path,sizeof(path),"%.*s",tok->len,tok->str);
+	char *full = realpath(path,NULL);
+	if(full == NULL) {
+		asmError(lineNum,"Assembler Error: File pointer \'%s\' not valid",path);
+		return;
+	}
+	struct Unit *inc;
+	pthread_mutex_lock(&parseLock);
+	for(inc=unitCache;inc!=NULL;inc=inc->next) {
+		if(!strcmp(inc->path,full)) {
+			break;
+		}
+	}
+	if(inc == NULL) {
+		inc = newUnit(full);
+		inc->next = unitCache;
+		unitCache = inc;
+		if(queueTail == maxQueue) {
+			maxQueue = maxQueue ? maxQueue * 2 : 64;
+			parseQueue = realloc(parseQueue,maxQueue * sizeof(struct Unit*));
+		}
+		parseQueue[queueTail++] = inc;
+		pthread_cond_broadcast(&parseCond);
+	}else {
+		free(full);
+	}
+	pthread_mutex_unlock(&parseLock);
+	struct Item *item = addItem(unit,ITEM_INCLUDE,lineNum);
+	item->unit = inc;
+	item->path = strndup(tok->str,tok->len);
+}
+
+/*
+ * Adds the machine code file named by tok to the unit.
+ */
+void includeBin(struct Unit *unit,struct Token *tok,int lineNum)
+{
+	char path[PATH_MAX];
+	snprintf(path,sizeof(path),"%.*s",tok->len,tok->str);
+	int fd = open(path,O_RDONLY);
+	size_t len;
+	int mapped;
+	char *bin = (fd < 0) ? NULL : loadSource(fd,&len,&mapped);
+	if(fd >= 0) {
+		close(fd);
+	}
+	if(bin == NULL) {
+		asmError(lineNum,"Assembler Error: File pointer \'%s\' not valid",path);
+		return;
+	}
+	if(len >= ROM_SIZE) {
+		asmError(lineNum,"Out of Memory Error");
+	}else if(len > 0) {
+		struct Item *item = addItem(unit,ITEM_BYTES,lineNum);
+		item->path = strndup(tok->str,tok->len);
+		item->bytes = malloc(len);
+		memcpy(item->bytes,bin,len);
+		item->len = len;
+	}
+	freeSource(bin,len,mapped);
+}
+
+/*
+ * Reports every label the unit jumps to but never defines.
+ */
+void checkLabels(struct Unit *unit)
+{
+	int i;
+	for(i=0;i<unit->numItems;i++) {
+		struct Item *item = &unit->items[i];
+		if(item->kind == ITEM_JUMP && item->sym >= 0 && !unit->symLines[item->sym]) {
+			// Object files can jump to labels of the main file defined in other object files
+			if(objMode && unit->path == NULL && unit->syms[item->sym][0] != '.') {
+				continue;
+			}
+			asmError(item->line,"Syntax Error: Label \'%s\' is not defined",unit->syms[item->sym]);
+		}
+	}
+}
+
+/*
+ * Appends the unit's items to the program, replacing each include with the
+ * included unit's items. Each copy of a unit gets its own set of labels.
+ */
+void expand(struct Unit *unit)
+{
+	int i, base = numSyms;
+	if(numSyms + unit->numSyms > maxSyms) {
+		maxSyms = (numSyms + unit->numSyms) * 2;
+		symNames = realloc(symNames,maxSyms * sizeof(char*));
+		symAddrs = realloc(symAddrs,maxSyms * sizeof(int));
+	}
+	for(i=0;i<unit->numSyms;i++) {
+		symNames[numSyms++] = unit->syms[i];
+	}
+	for(i=0;i<unit->numItems;i++) {
+		struct Item *item = &unit->items[i];
+		if(item->kind == ITEM_INCLUDE) {
+			expand(item->unit);
+			continue;
+		}
+		if(numProg == maxProg) {
+			maxProg = maxProg ? maxProg * 2 : 256;
+			prog = realloc(prog,maxProg * sizeof(struct Item));
+		}
+		prog[numProg] = *item;
+		if((item->kind == ITEM_LABEL || item->kind == ITEM_JUMP) && item->sym >= 0) {
+			prog[numProg].sym += base;
+		}
+		numProg++;
+	}
+}
+
+/*
+ * Splits the program into the sections of an object file. Each label of the
+ * main file that doesn't start with a period starts a new section, which link16
+ * leaves out if nothing jumps to it. Labels starting with a period are local to
+ * their section and object file.
+ */
+void splitSections()
+{
+	int i, section = 0;
+	symSections = malloc((numSyms + 1) * sizeof(int));
+	for(i=0;i<numSyms;i++) {
+		symSections[i] = -1;
+		symAddrs[i] = 0;
+	}
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		if(objMode && item->kind == ITEM_LABEL && item->sym < rootSyms && symNames[item->sym][0] != '.') {
+			section++;
+		}
+		item->section = section;
+		if(item->kind == ITEM_LABEL) {
+			symSections[item->sym] = section;
+		}
+	}
+	numSections = section + 1;
+}
+
+/*
+ * Reports jumps that can't be linked. Sections move when they are linked, and
+ * link16 only keeps sections that run on into each other or are jumped to by
+ * label, so jumps to ROM addresses, hand written relative jumps (ADDI / SUBI
+ * PC, PC and INCIZ / DECIN PC) that land in another section and every other
+ * write to the PC apart from a halt (move PC, r3) would go astray.
+ */
+void checkSections()
+{
+	int i, k, words[3] = { -1, -1, -1 };
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		if(item->kind == ITEM_BYTES) {
+			for(k=0;k+1<item->len;k+=2) {
+				words[0] = words[1];
+				words[1] = words[2];
+				words[2] = (item->bytes[k] << 8) | item->bytes[k + 1];
+				if((words[2] & 0x0F00) == 0x0F00 && !isHalt(words)) {
+					itemError(item,"Syntax Error: includebin code that writes the PC can't be used with -c");
+					break;
+				}
+			}
+			continue;
+		}
+		if(item->kind != ITEM_INSN) {
+			if(item->kind == ITEM_JUMP && item->sym < 0) {
+				itemError(item,"Syntax Error: %s to a ROM address can't be used with -c, jump to a label instead",
+					jumpNames[item->com - COM_JMP]);
+			}
+			if(item->kind == ITEM_JUMP || item->kind == ITEM_LABEL) {
+				words[0] = words[1] = words[2] = -1;
+			}
+			continue;
+		}
+		words[0] = words[1];
+		words[1] = words[2];
+		words[2] = (item->com << 12) | (item->d << 8) | (item->a << 4) | item->b;
+		if(item->d != 15) {
+			continue;
+		}
+		int disp;
+		if((item->com == 6 || item->com == 7) && item->a == 15) {
+			disp = (item->com == 6) ? item->b : -item->b;
+		}else if(item->com == 10 || item->com == 11) {
+			disp = (item->com == 10) ? item->a : -item->a;
+		}else {
+			if(!isHalt(words)) {
+				itemError(item,"Syntax Error: Writing an address into the PC can't be used with -c, jump to a label instead");
+			}
+			continue;
+		}
+		if(spanSection(i,disp) != item->section) {
+			itemError(item,"Syntax Error: Relative jump over a label can't be used with -c, jump to the label instead");
+		}
+	}
+}
+
+/*
+ * Follows a hand written relative jump at prog[i] over disp instructions, the same
+ * way as protectSpan().
+ *
+ * Returns: The section of the first item jumped over or landed on that isn't in
+ * 			the section of prog[i], otherwise the section of prog[i]
+ */
+int spanSection(int i,int disp)
+{
+	int words = 0, section = prog[i].section, step = (disp >= 0) ? 1 : -1, dist = (disp >= 0) ? disp : -disp;
+	for(i+=step;i>=0 && i<numProg && words<dist;i+=step) {
+		if(prog[i].section != section) {
+			return prog[i].section;
+		}
+		if(prog[i].kind == ITEM_BYTES) {
+			words += prog[i].len / 2;
+		}else if(prog[i].kind == ITEM_INSN || prog[i].kind == ITEM_JUMP) {
+			words++;
+		}
+	}
+	return section;
+}
+
+/*
+ * Replaces every constant load with the shortest machine code that loads it.
+ * The value of each register is followed through straight line code, so a load
+ * can be a single MOVE, NOT, ADDI or SUBI from a register holding a value close
+ * to it, a SETH when only the high byte differs, or nothing at all if the register
+ * already holds it. Otherwise it is a SET, and a SETH if the value is past 255.
+ * Values are forgotten at labels, includebin code and halts, and the scratch
+ * register at jumps. Hand written jumps and jumps to ROM addresses (jmp 5) could land
+ * anywhere, so if there are any, no values are followed at all (see handJumps()).
+ */
+void loadConstants()
+{
+	int i, j, n = 0, known[16];
+	int follow = handJumps(0) == JUMPS_NONE;
+	struct Item *out = malloc((numProg * 2 + 1) * sizeof(struct Item));
+	memset(known,-1,sizeof(known));
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		if(item->kind != ITEM_LOAD) {
+			out[n++] = *item;
+			if(follow) {
+				trackConstants(item,known);
+			}
+			continue;
+		}
+		struct Item seq[2];
+		int len = pickLoad(item,known,seq);
+		for(j=0;j<len;j++) {
+			out[n] = *item;
+			out[n].kind = ITEM_INSN;
+			out[n].com = seq[j].com;
+			out[n].a = seq[j].a;
+			out[n].b = seq[j].b;
+			out[n].len = 2;
+			n++;
+		}
+		if(follow && item->d < 13) {
+			known[item->d] = item->value;
+		}
+	}
+	free(prog);
+	prog = out;
+	numProg = n;
+	maxProg = numProg * 2 + 1;
+}
+
+/*
+ * Picks the shortest commands that load item->value into register item->d,
+ * given the known value of each register (-1 if unknown).
+ *
+ * Returns: The number of commands, with their command and operands in seq
+ */
+int pickLoad(struct Item *item,int *known,struct Item *seq)
+{
+	int r, d = item->d, v = item->value;
+	if(known[d] == v) {
+		return 0;
+	}
+	if(v < 256) {
+		seq[0].com = 8;
+		seq[0].a = v >> 4;
+		seq[0].b = v & 0xF;
+		return 1;
+	}
+	for(r=0;r<16;r++) {
+		if(known[r] < 0) {
+			continue;
+		}
+		int up = (v - known[r]) & 0xFFFF, down = (known[r] - v) & 0xFFFF;
+		seq[0].a = r;
+		if(known[r] == v || ((~known[r]) & 0xFFFF) == v) {
+			seq[0].com = (known[r] == v) ? 0 : 1;
+			seq[0].b = 0;
+			return 1;
+		}else if(up <= 15 || down <= 15) {
+			seq[0].com = (up <= 15) ? 6 : 7;
+			seq[0].b = (up <= 15) ? up : down;
+			return 1;
+		}
+	}
+	seq[1].com = 9;
+	seq[1].a = (v >> 12) & 0xF;
+	seq[1].b = (v >> 8) & 0xF;
+	if(known[d] >= 0 && (known[d] & 0xFF) == (v & 0xFF)) {
+		seq[0] = seq[1];
+		return 1;
+	}
+	seq[0].com = 8;
+	seq[0].a = (v >> 4) & 0xF;
+	seq[0].b = v & 0xF;
+	return 2;
+}
 
 /*
- * Main function. The total parsing of the assembly code is converted to machine code
- * for the emulator. Input is read from stdin and output is printed to stdout. Piping
- * is recommended. Any and all problems with the inputted code are printed at the end of the
- * process before printing the resulting code to stderr.
+ * Updates the known value of each register (-1 if unknown) after the item.
+ * Only r0 - r12 apart from IN are followed.
  */
-int main()
-{
-	// Assign main variables rom is the total memory to be used by the emulator
-	unsigned char rom[ROM_SIZE];
-	int lineNum = 1, romIndex = 0, err = 0;
-	char line[64];
-	// Read input until no more is provided
-	while(fgets(line,64,stdin) != NULL) {
-		
-		// First, we tokenize the line and count the total number of tokens provided (up to 5)
-		int tokSize = 1;
-		char *toks[6];
-		toks[0] = strtok(line," ,\n\t\r");
-		while((toks[tokSize] = strtok(NULL," ,\n\t\r")) != NULL || tokSize > 5) {
-			// If we reach a comment we are finished loading tokens for the line
-			if(toks[tokSize][0] == '#') {
-				break;
+void trackConstants(struct Item *item,int *known)
+{
+	if(item->kind == ITEM_JUMP) {
+		known[item->scratch] = -1;
+		return;
+	}
+	if(item->kind != ITEM_INSN || item->d == 15) {
+		memset(known,-1,16 * sizeof(int));
+		return;
+	}
+	int d = item->d, a = item->a, b = item->b, v = -1;
+	// Writes to IN are ignored, and OUT0 / OUT1 are never followed
+	if(d == 6 || d >= 13) {
+		return;
+	}
+	switch(item->com) {
+
+	case 0: // MOVE
+		v = known[a];
+		break;
+
+	case 1: // NOT
+		v = (known[a] < 0) ? -1 : ~known[a] & 0xFFFF;
+		break;
+
+	case 2: // AND
+	case 3: // OR
+	case 4: // ADD
+	case 5: // SUB
+		if(known[a] >= 0 && known[b] >= 0) {
+			switch(item->com) {
+			case 2: v = known[a] & known[b]; break;
+			case 3: v = known[a] | known[b]; break;
+			case 4: v = known[a] + known[b]; break;
+			default: v = (known[a] - known[b]) & 0xFFFF; break;
 			}
-			tokSize++;
 		}
-		// Check that the first token is not null (empty) and that there are tokens to parse
-		if(tokSize > 0 && toks[0] != NULL) {
-			// Check if the line is a comment
-			// If so, ignore line and continue
-			if(toks[0][0] == '#') {
+		break;
+
+	case 6: // ADDI
+		v = (known[a] < 0) ? -1 : known[a] + b;
+		break;
+
+	case 7: // SUBI
+		v = (known[a] < 0) ? -1 : (known[a] - b) & 0xFFFF;
+		break;
+
+	case 8: // SET
+		v = (a << 4) | b;
+		break;
+
+	case 9: // SETH
+		v = (known[d] < 0) ? -1 : (known[d] & 0xFF) | (((a << 4) | b) << 8);
+		break;
+
+	case 10: // INCIZ
+	case 11: // DECIN
+		if(known[b] >= 0 && known[d] >= 0) {
+			int taken = (item->com == 10) ? !known[b] : (known[b] & 0x8000);
+			v = !taken ? known[d] : (item->com == 10) ? known[d] + a : (known[d] - a) & 0xFFFF;
+		}
+		break;
+
+	default: // MOVEZ, MOVEX, MOVEP, MOVEN
+		if(known[b] >= 0) {
+			int taken = (item->com == 12) ? !known[b] : (item->com == 13) ? known[b] != 0 :
+				(item->com == 14) ? !(known[b] & 0x8000) : (known[b] & 0x8000);
+			v = taken ? known[a] : known[d];
+		}else if(known[a] == known[d]) {
+			v = known[d];
+		}
+		break;
+	}
+	known[d] = (v < 0) ? -1 : (v & 0xFFFF);
+}
+
+/*
+ * Peephole optimizer. Repeatedly applies the following to neighbouring commands
+ * until nothing changes, and reports how often each one was applied:
+ * 	move rX, rX / addi rX, rX, 0 / subi rX, rX, 0 do nothing and are removed
+ * 	Any command writing IN is ignored by the CPU and is removed
+ * 	SET or SETH followed by SET of the same register, or SETH followed by SETH,
+ * 	is overwritten before it is used and is removed
+ * 	ADDI / SUBI followed by ADDI / SUBI of the result are combined into one
+ * Labels, jumps and includebin code are never optimized across. Commands writing the
+ * PC, OUT0 or OUT1 are never changed, since their value is seen by the CPU every cycle.
+ * Removing commands moves everything after them, so nothing is removed between a hand
+ * written relative jump and its target, and nothing at all if the program jumps to
+ * addresses it works out itself or jumps to a ROM address instead of a label.
+ */
+void optimize()
+{
+	int i, j, changed = 1;
+	if(handJumps(1) == JUMPS_COMPUTED) {
+		fprintf(stderr,"Peephole: skipped, the program jumps to addresses that aren't labels\n");
+		return;
+	}
+	while(changed) {
+		changed = 0;
+		for(i=0;i<numProg;i++) {
+			struct Item *x = &prog[i];
+			if(x->kind != ITEM_INSN || x->keep) {
 				continue;
 			}
-			
-			int tI;
-			// Convert all characters in first token to lower case
-			for(tI=0;tI<strlen(toks[0]);tI++) {
-				if(isupper(toks[0][tI])) {
-					toks[0][tI] += 32;
-				}
+			if(x->d == 6) {
+				x->kind = ITEM_NONE;
+				optInputs++;
+				changed = 1;
+				continue;
 			}
-			// Check for include statement to import existing code
-			if(!strcmp(toks[0],"include")) {
-				if(tokSize < 2) {
-					fprintf(stderr,"line %d - Assembler Error: include statement requires file pointer\n",lineNum);
-					err++;
-				}else {
-					// Create new files for input and output for child process
-					FILE* file = fopen(toks[1],"r");
-					char name[32];
-					sprintf(name,"TMPBIN_%s.tmp~",toks[1]);
-					int i;
-					for(i=0;i<strlen(name);i++) {
-						name[i] = (name[i] == '/' || isspace(name[i])) ? '_' : name[i];
-					}
-					FILE* out = fopen(name,"w");
-					// Check to make sure input file exists
-					if(file == NULL) {
-						fprintf(stderr,"line %d - Assembler Error: File pointer \'%s\' not valid\n",lineNum,toks[1]);
-						err++;
-					}else {
-						// fork the process to assemble the new code file 
-						int child = fork();
-						if(fork < 0) {
-							fprintf(stderr,"line %d - Assembler Error: Unable to fork child process\n",lineNum);
-							err++;
-						}else {
-							if(child) { // Parent process
-								int status = 0;
-								// Wait for Child process to finish
-								while(waitpid(child,&status,WUNTRACED) > 0);
-								FILE* temp = fopen(name,"r");
-								if(temp == NULL) {
-									fprintf(stderr,"line %d - Assembler Error: Failed to read assembled code from \'%s\'\n",lineNum,toks[1]);
-									err++;
-								}else {
-									// Read in the entire machine code from the temporary file and save into the ROM
-									int c;
-									while((c = fgetc(temp)) != EOF) {
-										if(romIndex + 1 < ROM_SIZE) {
-											rom[romIndex++] = (unsigned char) c;
-										}else {
-											fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-											err++;
-										}
-									}
-									// Close the temporary file and delete it
-									fclose(temp);
-									if(remove(name)) {
-										fprintf(stderr,"line %d - Warning: Unable to delete temporary file\n",lineNum);
-									}
-								}
-							}else { // Child process
-								// Redirect stdin and stdout
-								dup2(fileno(file),STDIN_FILENO);
-								dup2(fileno(out),STDOUT_FILENO);
-								// Call a fresh copy of the assembler process with redirected I/O
-								execlp("./asm16","asm16",NULL);
-								fprintf(stderr,"line %d - Assembler Error: Unable to create new process\n",lineNum);
-								err++;
-							}
-						}
-					}
-				}
+			if(x->d >= 13) {
 				continue;
-			// Check for includebin statement to import existing binary machine code
-			}else if(!strcmp(toks[0],"includebin")) {
-				if(tokSize < 2) {
-					fprintf(stderr,"line %d - Assembler Error: includebin statement requires file pointer\n",lineNum);
-					err++;
-				}else {
-					FILE* file = fopen(toks[1],"r");
-					if(file == NULL) {
-						fprintf(stderr,"line %d - Assembler Error: File pointer \'%s\' not valid\n",lineNum,toks[1]);
-						err++;
-					}else {
-						// Read in the entire machine code file and save into the ROM
-						int c;
-						while((c = fgetc(file)) != EOF) {
-							if(romIndex + 1 < ROM_SIZE) {
-								rom[romIndex++] = (unsigned char) c;
-							}else {
-								fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-								err++;
-							}
-						}
-						fclose(file);
-					}
-				}
+			}
+			if(isNop(x)) {
+				x->kind = ITEM_NONE;
+				optMoves++;
+				changed = 1;
 				continue;
 			}
-			
-			// Get command number of the first token 
-			switch(getComNum(toks[0])) {
-				
-			case 0: // MOV
-				if(tokSize != 3) {
-					fprintf(stderr,"line %d - Syntax Error: MOVE (MOV) command takes 2 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						if(r1 < 0 || r2 < 0 || r1 > 15 || r2 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: MOVE (MOV) command takes 2 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xF & r1);
-							rom[romIndex++] = (unsigned char) (0xF0 & (r2 <<= 4));
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 1: // NOT
-				if(tokSize != 3) {
-					fprintf(stderr,"line %d - Syntax Error: NOT command takes 2 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						if(r1 < 0 || r2 < 0 || r1 > 15 || r2 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: NOT command takes 2 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x10 | (0xF & r1));
-							rom[romIndex++] = (unsigned char) (0xF0 & (r2 <<= 4));
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 2: // AND
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: AND command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: AND command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x20 | (0xF & r1));
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3));
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 3: // ORR
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: OR (ORR) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: OR (ORR) command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x30 | (0xF & r1));
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3));
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 4: // ADD
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: ADD command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: ADD command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x40 | (0xF & r1));
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3));
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 5: // SUB
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: SUB command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: SUB command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) 0x50 | (0xF & r1);
-							rom[romIndex++] = (unsigned char) (0xF0 & (r2 <<= 4)) | (0xF & r3);
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
+			// Find the next command, skipping any that were removed
+			for(j=i+1;j<numProg && prog[j].kind == ITEM_NONE;j++);
+			if(j == numProg) {
 				break;
-				
-			case 6: // ADI
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: ADDI (ADI) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getNormNum(toks[3]);
-						if(r1 == -1 || r2 == -1 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: ADDI (ADI) command takes 2 Registers and a Constant\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x60 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 7: // SBI
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: SUBI (SBI) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getNormNum(toks[3]);
-						if(r1 == -1 || r2 == -1 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15 || r3 < 0) {
-							fprintf(stderr,"line %d - Syntax Error: SUBI (SBI) command takes 2 Registers and a Constant\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x70 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 8: // SET
-				if(tokSize != 3) {
-					fprintf(stderr,"line %d - Syntax Error: SET command takes 2 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getNormNum(toks[2]);
-						if(r1 < 0 || r2 < 0 || r1 > 15 || r2 > 255) {
-							fprintf(stderr,"line %d - Syntax Error: SET command takes 1 Register and 1 Constant\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x80 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) (0xFF & r2) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 9: // STH
-				if(tokSize != 3) {
-					fprintf(stderr,"line %d - Syntax Error: SETH (STH) command takes 2 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getNormNum(toks[2]);
-						if(r1 < 0 || r2 < 0 || r1 > 15 || r2 > 255) {
-							fprintf(stderr,"line %d - Syntax Error: SETH (STH) command takes 1 Register and 1 Constant\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0x90 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) (0xFF & r2) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 10: // INC
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: INCIZ (INC) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getNormNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 == -1 || r2 == -1 || r3 == -1 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: INCIZ (INC) command takes 2 Registers and a Constant\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xA0 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 11: // DEC
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: DECIN (DEC) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getNormNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 == -1 || r3 == -1 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: DECIN (DEC) command takes 2 Registers and a Constant\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xB0 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 12: // MVZ
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: MOVEZ (MVZ) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: MOVEZ (MVZ) command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xC0 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
-				}
-				break;
-				
-			case 13: // MVX
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: MOVEX (MVX) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: MOVEX (MVX) command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xD0 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
+			}
+			struct Item *y = &prog[j];
+			if(y->kind != ITEM_INSN || y->keep || y->d != x->d) {
+				continue;
+			}
+			if((x->com == 8 || x->com == 9) && y->com == 8) {
+				x->kind = ITEM_NONE;
+				optSets++;
+				changed = 1;
+			}else if(x->com == 9 && y->com == 9) {
+				x->kind = ITEM_NONE;
+				optSets++;
+				changed = 1;
+			}else if((x->com == 6 || x->com == 7) && (y->com == 6 || y->com == 7) && y->a == y->d) {
+				int net = ((x->com == 6) ? x->b : -x->b) + ((y->com == 6) ? y->b : -y->b);
+				if(net >= -15 && net <= 15) {
+					x->com = (net >= 0) ? 6 : 7;
+					x->b = (net >= 0) ? net : -net;
+					y->kind = ITEM_NONE;
+					optAdds++;
+					changed = 1;
 				}
-				break;
-				
-			case 14: // MVP
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: MOVEP (MVP) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: MOVEP (MVP) command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xE0 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
+			}
+		}
+	}
+	for(i=j=0;i<numProg;i++) {
+		if(prog[i].kind != ITEM_NONE) {
+			prog[j++] = prog[i];
+		}
+	}
+	numProg = j;
+	fprintf(stderr,"Peephole: removed %d dead moves and %d writes to IN, folded %d SET/SETH, combined %d ADDI/SUBI\n",
+		optMoves,optInputs,optSets,optAdds);
+}
+
+/*
+ * Checks every hand written command that writes the PC. If protect is set, relative
+ * jumps (ADDI / SUBI PC, PC and INCIZ / DECIN PC) have their span protected from
+ * optimize(). Halting (moving xFFFF into the PC, as in lib/HALT) never lands anywhere.
+ * Jumps to a ROM address (jmp 5) count as computed, since any command could move
+ * under the address.
+ *
+ * Returns: JUMPS_NONE, JUMPS_RELATIVE or JUMPS_COMPUTED
+ */
+int handJumps(int protect)
+{
+	int i, k, words[3] = { -1, -1, -1 }, found = JUMPS_NONE;
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		if(item->kind == ITEM_BYTES) {
+			for(k=0;k+1<item->len;k+=2) {
+				words[0] = words[1];
+				words[1] = words[2];
+				words[2] = (item->bytes[k] << 8) | item->bytes[k + 1];
+				if((words[2] & 0x0F00) == 0x0F00 && !isHalt(words)) {
+					return JUMPS_COMPUTED;
 				}
-				break;
-				
-			case 15: // MVN
-				if(tokSize != 4) {
-					fprintf(stderr,"line %d - Syntax Error: MOVEN (MVN) command takes 3 arguments\n",lineNum);
-					err++;
-				}else {
-					if(romIndex + 1 < ROM_SIZE) {
-						int r1 = getRegNum(toks[1]);
-						int r2 = getRegNum(toks[2]);
-						int r3 = getRegNum(toks[3]);
-						if(r1 < 0 || r2 < 0 || r3 < 0 || r1 > 15 || r2 > 15 || r3 > 15) {
-							fprintf(stderr,"line %d - Syntax Error: MOVEN (MVN) command takes 3 Registers\n",lineNum);
-							err++;
-						}else {
-							rom[romIndex++] = (unsigned char) (0xF0 | (0xF & r1)) & 0xFF;
-							rom[romIndex++] = (unsigned char) ((0xF0 & (r2 <<= 4)) | (0xF & r3)) & 0xFF;
-						}
-					}else {
-						fprintf(stderr,"line %d - Out of Memory Error\n",lineNum);
-						err++;
-					}
+			}
+			continue;
+		}
+		if(item->kind != ITEM_INSN) {
+			// A jump to an address rather than a label lands wherever that address ends up
+			if(item->kind == ITEM_JUMP && item->sym < 0) {
+				return JUMPS_COMPUTED;
+			}
+			if(item->kind == ITEM_JUMP || item->kind == ITEM_LABEL) {
+				words[0] = words[1] = words[2] = -1;
+			}
+			continue;
+		}
+		words[0] = words[1];
+		words[1] = words[2];
+		words[2] = (item->com << 12) | (item->d << 8) | (item->a << 4) | item->b;
+		if(item->d != 15) {
+			continue;
+		}
+		if((item->com == 6 || item->com == 7) && item->a == 15) {
+			if(protect) {
+				protectSpan(i,(item->com == 6) ? item->b : -item->b);
+			}
+			found = JUMPS_RELATIVE;
+		}else if(item->com == 10 || item->com == 11) {
+			if(protect) {
+				protectSpan(i,(item->com == 10) ? item->a : -item->a);
+			}
+			found = JUMPS_RELATIVE;
+		}else if(!isHalt(words)) {
+			return JUMPS_COMPUTED;
+		}
+	}
+	return found;
+}
+
+/*
+ * Returns: 1 if the last three words are set rX, 255 / seth rX, 255 / move PC, rX,
+ * 			otherwise 0
+ */
+int isHalt(int *words)
+{
+	int r = (words[2] >> 4) & 0xF;
+	if(words[0] != (0x80FF | (r << 8)) || words[1] != (0x90FF | (r << 8)) || (words[2] & 0xFF0F) != 0x0F00) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Protects the commands a hand written relative jump at prog[i] jumps over, and
+ * the one it lands on, from being changed by optimize().
+ */
+void protectSpan(int i,int disp)
+{
+	int words = 0, step = (disp >= 0) ? 1 : -1, dist = (disp >= 0) ? disp : -disp;
+	for(i+=step;i>=0 && i<numProg && words<dist;i+=step) {
+		prog[i].keep = 1;
+		if(prog[i].kind == ITEM_BYTES) {
+			words += prog[i].len / 2;
+		}else if(prog[i].kind == ITEM_INSN || prog[i].kind == ITEM_JUMP) {
+			words++;
+		}
+	}
+}
+
+/*
+ * Returns: 1 if the command does nothing (move rX, rX or adding / subtracting 0
+ * 			from a register into itself), otherwise 0
+ */
+int isNop(struct Item *item)
+{
+	if(item->com == 0) {
+		return item->a == item->d;
+	}
+	return (item->com == 6 || item->com == 7) && item->a == item->d && item->b == 0;
+}
+
+/*
+ * Lays out the program, giving every item and label an address.
+ * Every jump starts out as short as possible and is only ever made longer,
+ * until every jump reaches its target. Since jumps never shrink, this always settles.
+ */
+void relax()
+{
+	int i, addr, changed = 1;
+	for(i=0;i<numProg;i++) {
+		if(prog[i].kind == ITEM_JUMP) {
+			prog[i].len = 2;
+		}
+	}
+	while(changed) {
+		changed = 0;
+		addr = 0;
+		for(i=0;i<numProg;i++) {
+			prog[i].addr = addr;
+			if(prog[i].kind == ITEM_LABEL) {
+				symAddrs[prog[i].sym] = addr;
+			}
+			addr += prog[i].len;
+		}
+		for(i=0;i<numProg;i++) {
+			if(prog[i].kind == ITEM_JUMP) {
+				int len = jumpSize(&prog[i]);
+				if(len > prog[i].len) {
+					prog[i].len = len;
+					changed = 1;
 				}
-				break;
-				
-			default: // ERROR
-				fprintf(stderr,"line %d - Unrecognized Command: \'%s\'\n",lineNum,toks[0]);
-				err++;
-				break;
 			}
 		}
-		lineNum++;
 	}
-	// If no errors were found, the rom data can be printed to stdout.
-	if(!err) {
-		fprintf(stderr,"Total Bytes Written: %d\n",romIndex);
-		fwrite(rom,sizeof(char),romIndex,stdout);
+	for(i=0;i<numProg;i++) {
+		if(prog[i].kind == ITEM_LABEL && prog[i].addr % 2) {
+			itemError(&prog[i],"Assembler Error: Label \'%s\' is not on an instruction, check includebin sizes",symNames[prog[i].sym]);
+		}
 	}
-	return 0;
 }
 
 /*
- * Converts the provided string into the command number.
- * 
- * Returns: The decimal equivalent of the machine code number for the
- * 			provided commmand, or -1 if an invalid string is provided.
- */
-int getComNum(char *str)
-{
-	// Short 3 character commands
-	const char *coms[] = {
-		"mov", "not", "and", "orr", 
-		"add", "sub", "adi", "sbi", 
-		"set", "sth", "inc", "dec", 
-		"mvz", "mvx", "mvp", "mvn"
-	};
-	
-	// Long commands (specified by professor in class)
-	const char *lComs[] = {
-		"move", "not", "and", "or", 
-		"add", "sub", "addi", "subi", 
-		"set", "seth", "inciz", "decin", 
-		"movez", "movex", "movep", "moven"
-	};
-	
+ * Works out the shortest machine code for a jump from its address to its target.
+ * When the target is within 15 instructions, jumps are a single ADDI or SUBI on
+ * the PC, and JZ (forwards) and JN (backwards) are a single INCIZ or DECIN.
+ * Otherwise the target is loaded into the scratch register with SET (and SETH
+ * if it is past 255) and moved into the PC by a MOVE or conditional move.
+ *
+ * Returns: The number of bytes the jump needs
+ */
+int jumpSize(struct Item *item)
+{
+	int from = item->addr / 2;
+	int to = (item->sym >= 0) ? symAddrs[item->sym] / 2 : item->target;
+	int disp = to - from;
+	// In an object file, sections move when linked, so only jumps within a section
+	// can be relative, and jumps to labels always have room for the full address
+	if(objMode && (item->sym < 0 || symSections[item->sym] != item->section)) {
+		return (item->sym >= 0 || to > 255) ? 6 : 4;
+	}
+	switch(item->com) {
+
+	case COM_JMP:
+		if(disp >= -15 && disp <= 15) {
+			return 2;
+		}
+		break;
+
+	case COM_JZ:
+		if(disp >= 0 && disp <= 15) {
+			return 2;
+		}
+		break;
+
+	case COM_JN:
+		if(disp >= -15 && disp <= 0) {
+			return 2;
+		}
+		break;
+	}
+	return (to > 255 || objMode) ? 6 : 4;
+}
+
+/*
+ * Writes the machine code of every item in the laid out program to the rom.
+ */
+void emit()
+{
 	int i;
-	// Check short command names first
-	for(i=0;i<16;i++) {
-		if(!strcmp(str,coms[i])) {
-			return i;
+	if(numProg > 0 && prog[numProg - 1].addr + prog[numProg - 1].len >= ROM_SIZE) {
+		fprintf(stderr,"Out of Memory Error\n");
+		err++;
+		return;
+	}
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		switch(item->kind) {
+
+		case ITEM_INSN:
+			rom[romIndex++] = (unsigned char) ((item->com << 4) | item->d);
+			rom[romIndex++] = (unsigned char) ((item->a << 4) | item->b);
+			break;
+
+		case ITEM_BYTES:
+			memcpy(&rom[romIndex],item->bytes,item->len);
+			romIndex += item->len;
+			break;
+
+		case ITEM_JUMP:
+			emitJump(item);
+			break;
+		}
+	}
+}
+
+/*
+ * Writes the machine code for a jump, in the form chosen by relax().
+ */
+void emitJump(struct Item *item)
+{
+	int from = item->addr / 2;
+	int to = (item->sym >= 0) ? symAddrs[item->sym] / 2 : item->target;
+	int disp = to - from, com, d = 15, a, b;
+	if(item->len == 2) {
+		switch(item->com) {
+		case COM_JMP: // ADDI or SUBI PC, PC, disp
+			com = (disp >= 0) ? 6 : 7;
+			a = 15;
+			b = (disp >= 0) ? disp : -disp;
+			break;
+		case COM_JZ: // INCIZ PC, disp, cond
+			com = 10;
+			a = disp;
+			b = item->cond;
+			break;
+		default: // DECIN PC, -disp, cond
+			com = 11;
+			a = -disp;
+			b = item->cond;
+			break;
+		}
+	}else {
+		if(objMode && item->sym >= 0) {
+			if(numRelocs == maxRelocs) {
+				maxRelocs = maxRelocs ? maxRelocs * 2 : 64;
+				relocs = realloc(relocs,maxRelocs * sizeof(struct Reloc));
+			}
+			relocs[numRelocs].section = item->section;
+			relocs[numRelocs].offset = romIndex;
+			relocs[numRelocs++].sym = item->sym;
+		}
+		// SET (and SETH) the scratch register to the target
+		rom[romIndex++] = (unsigned char) (0x80 | item->scratch);
+		rom[romIndex++] = (unsigned char) (to & 0xFF);
+		if(item->len == 6) {
+			rom[romIndex++] = (unsigned char) (0x90 | item->scratch);
+			rom[romIndex++] = (unsigned char) ((to >> 8) & 0xFF);
+		}
+		// Then move it into the PC
+		com = jumpMoves[item->com - COM_JMP];
+		a = item->scratch;
+		b = (item->cond < 0) ? 0 : item->cond;
+	}
+	rom[romIndex++] = (unsigned char) ((com << 4) | d);
+	rom[romIndex++] = (unsigned char) ((a << 4) | b);
+}
+
+/*
+ * Writes a debug map of the laid out program to path, for emu16 --map. It is a
+ * text file starting with MAP_MAGIC, followed by a line for each:
+ * 	source file:  F <number> <path>
+ * 	label:        L <address> <name>
+ * 	source line:  S <address> <file number> <line>
+ * 	end:          E <address>
+ * Addresses are ROM addresses (instructions, not bytes) in hexadecimal. Each S
+ * line covers every address up to the next one, or the end of the program.
+ */
+void writeMap(const char *path)
+{
+	FILE *fp = fopen(path,"w");
+	if(fp == NULL) {
+		fprintf(stderr,"Assembler Error: Unable to write debug map \'%s\'\n",path);
+		err++;
+		return;
+	}
+	const char **files = malloc((numProg + 1) * sizeof(char*));
+	int i, j, numFiles = 0, lastFile = -1, lastLine = -1;
+	fprintf(fp,"%s\n",MAP_MAGIC);
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		if(item->kind == ITEM_LABEL) {
+			fprintf(fp,"L %04x %s\n",item->addr / 2,symNames[item->sym]);
+			continue;
+		}
+		if(item->len == 0) {
+			continue;
+		}
+		// Every item of a file points at the same path, so files are told apart by pointer
+		for(j=0;j<numFiles && files[j] != item->file;j++);
+		if(j == numFiles) {
+			files[numFiles++] = item->file;
+			fprintf(fp,"F %d %s\n",j,(item->file != NULL) ? item->file : "<stdin>");
+		}
+		if(j != lastFile || item->line != lastLine) {
+			fprintf(fp,"S %04x %d %d\n",item->addr / 2,j,item->line);
+			lastFile = j;
+			lastLine = item->line;
+		}
+	}
+	fprintf(fp,"E %04x\n",romIndex / 2);
+	free(files);
+	fclose(fp);
+}
+
+/*
+ * Writes the program to stdout as a relocatable object file for link16. Every
+ * number is 16 bits, high byte first like the machine code:
+ * 	"O16" and a zero byte
+ * 	the number of sections, symbols and relocations
+ * 	each section's size in bytes and flags (SEC_RUNS_ON)
+ * 	each label's flags (SYM_GLOBAL), section (SYM_UNDEFINED if it is defined
+ * 		in another object file), byte offset in the section, name length and name
+ * 	each relocation's section, byte offset of the SET / SETH pair in the section
+ * 		and label
+ * 	the machine code of every section, one after the other
+ */
+void writeObject()
+{
+	int i, *starts = calloc(numSections + 1,sizeof(int)), *flags = calloc(numSections,sizeof(int));
+	struct Item *last = NULL;
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		if(i == 0 || item->section != prog[i - 1].section) {
+			starts[item->section] = item->addr;
+			if(item->section > 0) {
+				flags[item->section - 1] = runsOn(last);
+				last = NULL;
+			}
+		}
+		if(item->kind != ITEM_LABEL) {
+			last = item;
+		}
+	}
+	flags[numSections - 1] = runsOn(last);
+	starts[numSections] = romIndex;
+	// Sizes and offsets are written as 16 bit numbers
+	for(i=0;i<numProg;i++) {
+		struct Item *item = &prog[i];
+		int size = starts[item->section + 1] - starts[item->section];
+		if((i == 0 || item->section != prog[i - 1].section) && size > 0xFFFF) {
+			itemError(item,"Assembler Error: Section \'%s\' is %d bytes, sections in an object file can be at most %d bytes",
+				(item->kind == ITEM_LABEL) ? symNames[item->sym] : "<start>",size,0xFFFF);
+		}
+	}
+	if(err) {
+		free(starts);
+		free(flags);
+		return;
+	}
+	fwrite(OBJ_MAGIC,1,4,stdout);
+	writeNum(numSections);
+	writeNum(numSyms);
+	writeNum(numRelocs);
+	for(i=0;i<numSections;i++) {
+		writeNum(starts[i + 1] - starts[i]);
+		writeNum(flags[i]);
+	}
+	for(i=0;i<numSyms;i++) {
+		int section = symSections[i];
+		writeNum((i < rootSyms && symNames[i][0] != '.') ? SYM_GLOBAL : 0);
+		writeNum((section < 0) ? SYM_UNDEFINED : section);
+		writeNum((section < 0) ? 0 : symAddrs[i] - starts[section]);
+		writeNum(strlen(symNames[i]));
+		fputs(symNames[i],stdout);
+	}
+	for(i=0;i<numRelocs;i++) {
+		writeNum(relocs[i].section);
+		writeNum(relocs[i].offset - starts[relocs[i].section]);
+		writeNum(relocs[i].sym);
+	}
+	fwrite(rom,sizeof(char),romIndex,stdout);
+	fprintf(stderr,"Total Bytes Written: %d in %d sections\n",romIndex,numSections);
+	free(starts);
+	free(flags);
+}
+
+/*
+ * Returns: 1 if the program can run on past the item that ends a section (it
+ * 			isn't a jmp, or a command or includebin code ending in a MOVE,
+ * 			ADDI or SUBI into the PC), otherwise 0
+ */
+int runsOn(struct Item *item)
+{
+	int word;
+	if(item == NULL) {
+		return SEC_RUNS_ON;
+	}
+	switch(item->kind) {
+
+	case ITEM_JUMP:
+		return (item->com == COM_JMP) ? 0 : SEC_RUNS_ON;
+
+	case ITEM_BYTES:
+		if(item->len < 2) {
+			return SEC_RUNS_ON;
+		}
+		word = (item->bytes[item->len - 2] << 8) | item->bytes[item->len - 1];
+		break;
+
+	default:
+		word = (item->com << 12) | (item->d << 8) | (item->a << 4) | item->b;
+		break;
+	}
+	int com = word >> 12;
+	return ((word & 0x0F00) == 0x0F00 && (com == 0 || com == 6 || com == 7)) ? 0 : SEC_RUNS_ON;
+}
+
+/*
+ * Writes a 16 bit number to stdout, high byte first.
+ */
+void writeNum(int num)
+{
+	putchar((num >> 8) & 0xFF);
+	putchar(num & 0xFF);
+}
+
+/*
+ * Loads the entire contents of the file descriptor fd into memory.
+ * Regular files are mapped straight into memory, anything else (like a pipe)
+ * is read into a buffer.
+ *
+ * Returns: The contents, to be released with freeSource(), or NULL if fd can't be read
+ */
+char *loadSource(int fd,size_t *len,int *mapped)
+{
+	struct stat st;
+	if(fstat(fd,&st)) {
+		return NULL;
+	}
+	if(S_ISREG(st.st_mode) && st.st_size > 0) {
+		char *src = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(src != MAP_FAILED) {
+			*len = st.st_size;
+			*mapped = 1;
+			return src;
 		}
 	}
-	
-	// Check long command names
-	for(i=0;i<16;i++) {
-		if(!strcmp(str,lComs[i])) {
-			return i;
+	size_t size = 4096;
+	char *buf = malloc(size);
+	ssize_t n;
+	*len = 0;
+	*mapped = 0;
+	while((n = read(fd,buf + *len,size - *len)) > 0) {
+		*len += n;
+		if(*len == size) {
+			size *= 2;
+			buf = realloc(buf,size);
 		}
 	}
+	if(n < 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * Releases source loaded by loadSource().
+ */
+void freeSource(char *src,size_t len,int mapped)
+{
+	if(mapped) {
+		munmap(src,len);
+	}else {
+		free(src);
+	}
+}
+
+/*
+ * Reports an error for line lineNum of the file being parsed.
+ */
+void asmError(int lineNum,const char *fmt,...)
+{
+	va_list args;
+	va_start(args,fmt);
+	vError((curUnit != NULL) ? curUnit->path : NULL,lineNum,fmt,args);
+	va_end(args);
+}
+
+/*
+ * Prints an error for the line an item was parsed from to stderr and counts it.
+ */
+void itemError(struct Item *item,const char *fmt,...)
+{
+	va_list args;
+	va_start(args,fmt);
+	vError(item->file,item->line,fmt,args);
+	va_end(args);
+}
+
+/*
+ * Prints an error for line lineNum of file (NULL for stdin) to stderr and counts it.
+ * While a file is being parsed, the error is kept with its unit instead (see checkIncludes()).
+ */
+void vError(const char *file,int lineNum,const char *fmt,va_list args)
+{
+	FILE *out = (curUnit != NULL && curUnit->errs != NULL) ? curUnit->errs : stderr;
+	if(file != NULL) {
+		fprintf(out,"%s: ",file);
+	}
+	fprintf(out,"line %d - ",lineNum);
+	vfprintf(out,fmt,args);
+	fprintf(out,"\n");
+	if(out == stderr) {
+		err++;
+	}else {
+		curUnit->numErrors++;
+	}
+}
+
+/*
+ * Hashes a name from its length, first, middle and last characters. Names are
+ * compared without case, so every character is lowercased first (ORing in 0x20
+ * leaves digits as they are).
+ *
+ * Returns: A slot between 0 and size - 1 (size is a power of 2)
+ */
+int hashName(struct Token *tok,int a,int b,int c,int size)
+{
+	const char *s = tok->str;
+	int len = tok->len;
+	return (len * a + (s[0] | 0x20) * b + (s[len - 1] | 0x20) * c + (s[len / 2] | 0x20)) & (size - 1);
+}
+
+/*
+ * Converts the provided token into the command number.
+ *
+ * Returns: The decimal equivalent of the machine code number for the
+ * 			provided commmand, COM_INCLUDE or COM_INCLUDEBIN for the include
+ * 			statements, or -1 if an invalid string is provided.
+ */
+int getComNum(struct Token *tok)
+{
+	const struct Keyword *k = &commands[hashName(tok,1,5,9,128)];
+	if(k->name != NULL && strlen(k->name) == tok->len && !strncasecmp(k->name,tok->str,tok->len)) {
+		return k->num;
+	}
 	return -1;
 }
 
 /*
- * Parses a string to find its corresponding register number.
- * String must be 2 characters long. The first character being the letter r (or R).
- * The second character must be a hexadecimal number (0 - F) or a decimal number (0 - 15)
+ * Parses a token to find its corresponding register number.
+ * The first character must be the letter r (or R) followed by a hexadecimal
+ * number (0 - F) or a decimal number (0 - 15).
  * Also will parse PC (Program Counter) to the decimal value 15 (hex F)
  * Parses the macros out0 or output0, out1 or output1, in or input to their respective registers
- * 
+ *
  * Returns: The decimal equivalent of the hexadecimal register number provided
  * 			or -1 if non-valid string provided
  */
-int getRegNum(char *str)
+int getRegNum(struct Token *tok)
 {
-	// Convert letters to lowercase
-	int i;
-	for(i=0;i<strlen(str);i++) {
-		if(isupper(str[i])){
-			str[i] += 32; 
-		}
-	}
-	// Macro for program counter register
-	if(!strcmp(str,"pc")) {
-		return 15;
-	// Macro for output 0 register
-	}else if(!strcmp(str,"out0") || !strcmp(str,"output0")) {
-		return 13;
-	// Macro for output 1 register
-	}else if(!strcmp(str,"out1") || !strcmp(str,"output1")) {
-		return 14;
-	// Macro for input register
-	}else if(!strcmp(str,"in") || !strcmp(str,"input")) {
-		return 6;
-	}
-	
-	if(strlen(str) >= 2 && (str[0] == 'r')) {
-		// If it's not a digit, check hexadecimal value
-		if(isdigit(str[1])) {
-			return atoi(&str[1]);
-		}else {
-			const char l[] = {'a','b','c','d','e','f'};
-			for(i=0;i<6;i++) {
-				if(str[1] == l[i]) {
-					return i+10;
-				}
-			}
-		}
+	const struct Keyword *k = &registers[hashName(tok,5,6,12,64)];
+	if(k->name != NULL && strlen(k->name) == tok->len && !strncasecmp(k->name,tok->str,tok->len)) {
+		return k->num;
 	}
 	return -1;
 }
@@ -630,40 +2048,49 @@ int getRegNum(char *str)
  *  Parses a number constant and returns its decimal value
  *  Value can be hexadecimal (starts with x), binary (starts with b)
  *  or just regular decimal.
+ *
+ *  Returns: The value, or -1 if the token is not a valid number
  */
-int getNormNum(char* str)
+int getNormNum(struct Token *tok)
 {
-	int num, i, fac;
-	switch(str[0]) {
-		
+	const char *s = tok->str;
+	int i, base = 10, start = 0;
+	long num = 0;
+	switch(s[0]) {
+
 	case 'x':
 	case 'X':
-		num = 0;
-		fac = 1;
-		for(i=strlen(str)-1;i>0;i--) {
-			if(isdigit(str[i])) {
-				num += fac * (str[i] - 48);
-			}else if(str[i] >= 'a' && str[i] <= 'f') {
-				num += fac * (str[i] - 87);
-			}else if(str[i] >= 'A' && str[i] <= 'F') {
-				num += fac * (str[i] - 55);
-			}
-			fac *= 16;
-		}
-		return num;
-	
+		base = 16;
+		start = 1;
+		break;
+
 	case 'b':
 	case 'B':
-		num = 0;
-		i = 1;
-		while(str[i] != '\0') {
-			num <<= 1;
-			num |= (str[i] == '1') ? 1 : 0;
-			i += 1;
-		}
-		return num;
-		
-	default:
-		return atoi(str);
+		base = 2;
+		start = 1;
+		break;
+	}
+	if(start >= tok->len) {
+		return -1;
+	}
+	for(i=start;i<tok->len;i++) {
+		int digit;
+		if(isdigit(s[i])) {
+			digit = s[i] - '0';
+		}else if(s[i] >= 'a' && s[i] <= 'f') {
+			digit = s[i] - 'a' + 10;
+		}else if(s[i] >= 'A' && s[i] <= 'F') {
+			digit = s[i] - 'A' + 10;
+		}else {
+			return -1;
+		}
+		if(digit >= base) {
+			return -1;
+		}
+		num = num * base + digit;
+		if(num > INT_MAX) {
+			return -1;
+		}
 	}
+	return (int) num;
 }
@@ -0,0 +1,39 @@
+/*
+ * CSC 364 Disassembler
+ * Prints the assembly for a rom, which asm16 can assemble back into the same rom.
+ * For listings with the number of times each instruction ran, see emu16 --profile.
+ */
+
+#include <stdio.h>
+#include "disasm.h"
+
+// Total number of instructions in a rom
+#define ROM_SIZE 65534
+
+unsigned short code[ROM_SIZE];
+
+/*
+ * Main function. Reads the rom from stdin and prints its listing to stdout.
+ */
+int main(int argc,char **argv)
+{
+	int c, len = 0, odd = 0;
+	if(argc > 1) {
+		fprintf(stderr,"Unknown Argument: \'%s\'\n",argv[1]);
+		fprintf(stderr,"Usage: dis16 < input.rom > output.file\n");
+		return 1;
+	}
+	while(len < ROM_SIZE && (c = getchar()) != EOF) {
+		int low = getchar();
+		if(low == EOF) {
+			odd = 1;
+			low = 0;
+		}
+		code[len++] = (unsigned short) ((c << 8) | low);
+	}
+	disListing(stdout,code,len,NULL,NULL);
+	if(odd) {
+		fprintf(stderr,"Warning: The rom ends half way through an instruction\n");
+	}
+	return 0;
+}
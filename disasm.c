@@ -0,0 +1,165 @@
+/*
+ * CSC 364 Disassembler
+ * Turns machine code back into assembly for asm16. Every instruction word is
+ * decoded once into a table, so disassembling one is a single lookup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "disasm.h"
+
+// Number of instructions listed in the summary of an annotated listing
+#define DIS_HOTTEST 10
+
+// Operand formats, the same as in assembler.c
+#define FMT_RR 0	// rD, rA
+#define FMT_RRR 1	// rD, rA, rB
+#define FMT_RRC 2	// rD, rA, constant
+#define FMT_RC 3	// rD, 8 bit constant
+#define FMT_RCR 4	// rD, constant, rB
+
+// Operand format and name of each machine code command
+const int disFormats[16] = {
+	FMT_RR, FMT_RR, FMT_RRR, FMT_RRR,
+	FMT_RRR, FMT_RRR, FMT_RRC, FMT_RRC,
+	FMT_RC, FMT_RC, FMT_RCR, FMT_RCR,
+	FMT_RRR, FMT_RRR, FMT_RRR, FMT_RRR
+};
+const char *disNames[16] = {
+	"move", "not", "and", "or",
+	"add", "sub", "addi", "subi",
+	"set", "seth", "inciz", "decin",
+	"movez", "movex", "movep", "moven"
+};
+// Register names, using the assembler's macros for the special registers
+const char *disRegs[16] = {
+	"r0", "r1", "r2", "r3", "r4", "r5", "IN", "r7",
+	"r8", "r9", "r10", "r11", "r12", "OUT0", "OUT1", "PC"
+};
+
+// The assembly for every instruction word, filled in by buildTable()
+char (*disTable)[DIS_TEXT_LEN] = NULL;
+
+/*
+ * Decodes every instruction word into disTable.
+ */
+void buildTable()
+{
+	int word;
+	disTable = malloc(65536 * DIS_TEXT_LEN);
+	for(word=0;word<65536;word++) {
+		int com = word >> 12, d = (word >> 8) & 0xF, a = (word >> 4) & 0xF, b = word & 0xF;
+		char *text = disTable[word];
+		switch(disFormats[com]) {
+
+		case FMT_RR:
+			snprintf(text,DIS_TEXT_LEN,"%s %s, %s",disNames[com],disRegs[d],disRegs[a]);
+			break;
+
+		case FMT_RRR:
+			snprintf(text,DIS_TEXT_LEN,"%s %s, %s, %s",disNames[com],disRegs[d],disRegs[a],disRegs[b]);
+			break;
+
+		case FMT_RRC:
+			snprintf(text,DIS_TEXT_LEN,"%s %s, %s, %d",disNames[com],disRegs[d],disRegs[a],b);
+			break;
+
+		case FMT_RC:
+			snprintf(text,DIS_TEXT_LEN,"%s %s, x%02X",disNames[com],disRegs[d],word & 0xFF);
+			break;
+
+		case FMT_RCR:
+			snprintf(text,DIS_TEXT_LEN,"%s %s, %d, %s",disNames[com],disRegs[d],a,disRegs[b]);
+			break;
+		}
+	}
+}
+
+/*
+ * Returns: The assembly for the instruction word
+ */
+const char *disInstr(unsigned short word)
+{
+	if(disTable == NULL) {
+		buildTable();
+	}
+	return disTable[word];
+}
+
+/*
+ * Works out where the instruction word at ROM address addr jumps to, for the
+ * PC relative jumps the assembler writes (ADDI / SUBI PC, PC and INCIZ / DECIN PC).
+ *
+ * Returns: The address jumped to, or -1 if the instruction isn't a relative jump
+ */
+int disTarget(unsigned short word,int addr)
+{
+	int com = word >> 12, d = (word >> 8) & 0xF, a = (word >> 4) & 0xF, b = word & 0xF;
+	if(d != 15) {
+		return -1;
+	}
+	if(a == 15 && (com == 6 || com == 7)) {
+		return (com == 6) ? addr + b : addr - b;
+	}
+	if(com == 10 || com == 11) {
+		return (com == 10) ? addr + a : addr - a;
+	}
+	return -1;
+}
+
+/*
+ * Writes a listing of the len instruction words in code to out, one instruction
+ * per line followed by a comment with its address, machine code and where it jumps to.
+ * The listing can be assembled back into the same ROM, apart from the unused
+ * last register field of MOVE and NOT, which is always assembled as 0.
+ * If counts is given (the number of times each address was executed), each line
+ * also shows its count and share of the clock cycles, and the listing starts
+ * with a summary of the instructions that took the most cycles.
+ * If notes is given, the note for each address (such as where it came from in the
+ * source) ends its line, unless it is NULL.
+ */
+void disListing(FILE *out,const unsigned short *code,int len,const unsigned long long *counts,const char *const *notes)
+{
+	unsigned long long total = 0;
+	int i, j, hottest[DIS_HOTTEST], numHottest = 0;
+	if(counts) {
+		// Keep the addresses with the highest counts, highest first
+		for(i=0;i<len;i++) {
+			total += counts[i];
+			if(!counts[i] || (numHottest == DIS_HOTTEST && counts[i] <= counts[hottest[numHottest - 1]])) {
+				continue;
+			}
+			if(numHottest < DIS_HOTTEST) {
+				numHottest++;
+			}
+			for(j=numHottest-1;j>0 && counts[hottest[j - 1]] < counts[i];j--) {
+				hottest[j] = hottest[j - 1];
+			}
+			hottest[j] = i;
+		}
+		fprintf(out,"# %llu clock cycles, the most were spent on:\n",total);
+		for(i=0;i<numHottest;i++) {
+			fprintf(out,"#\t%04X  %-*s %12llu %6.2f%%",hottest[i],DIS_TEXT_LEN,disInstr(code[hottest[i]]),
+				counts[hottest[i]],100.0 * counts[hottest[i]] / total);
+			if(notes && notes[hottest[i]]) {
+				fprintf(out,"  %s",notes[hottest[i]]);
+			}
+			fprintf(out,"\n");
+		}
+		fprintf(out,"\n");
+	}
+	for(i=0;i<len;i++) {
+		int to = disTarget(code[i],i);
+		fprintf(out,"\t%-*s # %04X  %04X",DIS_TEXT_LEN,disInstr(code[i]),i,code[i]);
+		if(counts) {
+			fprintf(out," %12llu %6.2f%%",counts[i],total ? 100.0 * counts[i] / total : 0.0);
+		}
+		if(to >= 0) {
+			fprintf(out,"  -> %04X",to & 0xFFFF);
+		}
+		if(notes && notes[i]) {
+			fprintf(out,"  %s",notes[i]);
+		}
+		fprintf(out,"\n");
+	}
+}
@@ -0,0 +1,26 @@
+/*
+ * CSC 364 Disassembler
+ * Disassembly functions shared by dis16 and emu16, see disasm.c.
+ */
+
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Longest line of assembly for a single instruction, including the terminator
+#define DIS_TEXT_LEN 24
+
+const char *disInstr(unsigned short);
+int disTarget(unsigned short,int);
+void disListing(FILE*,const unsigned short*,int,const unsigned long long*,const char *const*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,9 +10,25 @@
  
 #include <iostream>
 #include <fstream>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
+#include <strings.h>
 #include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <cstddef>
+#include <climits>
+#include "disasm.h"
 
 // Register 15 (F) is the program counter
 // Registers 13 (D) and 14 (E) are output registers
@@ -22,19 +38,235 @@
 // Total RAM size is all 16 bit addresses (2^16)
 #define ROM_SIZE 65534 
 #define RAM_SIZE 65536
+// RAM is hashed a page at a time, so pages never written needn't be read (see hashState())
+#define RAM_PAGE_BITS 8
+#define RAM_PAGES (RAM_SIZE >> RAM_PAGE_BITS)
 #define SCREEN_WIDTH 16
 #define PROG_COUNTER 15
 #define INPUT 6
 #define OUTPUT1 13
 #define OUTPUT2 14
 
+// Each decoded ROM word keeps the 16 bit instruction in its low bits.
+// Debugging traps are patched into the bits above it, which pushes the
+// opcode out of the 0 - 15 range so processIn() falls into its catch-all
+// case. Instructions without a trap run exactly as fast as before.
+#define INSTR_MASK 0xFFFF
+#define TRAP_BREAK 0x10000
+#define TRAP_WATCH 0x20000
+#define TRAP_UNTIL 0x40000
+// Patched onto every instruction that writes the PC (the end of each basic
+// block) when a cycle budget or timeout is set, so limits are never checked
+// in the middle of straight line code.
+#define TRAP_BLOCK 0x80000
+// Patched onto every instruction when profiling, so the count of each address
+// is kept by handleTrap() and runs without --profile don't pay for it.
+#define TRAP_COUNT 0x100000
+
+// Flags for each RAM address in Machine::ramWatch
+#define RAM_WATCH 1
+#define RAM_UNTIL 2
+
+// Number of basic blocks executed between reads of the wall clock
+#define CLOCK_CHECK 4096
+
+// Header of a screen frame stream (see writeFrame())
+#define FRAME_MAGIC "EMU16FR1"
+
+// First line of a debug map written by asm16 -g (see loadMap())
+#define MAP_MAGIC "EMU16MAP1"
+
+// Most breakpoints or stop conditions a single run can have
+#define MAX_POINTS 256
+
+// Number of decoded ROMs each job server worker keeps (see loadRom())
+#define ROM_CACHE_SIZE 16
+
+// Most CPUs sharing RAM (--cores), and the default number of cycles each one
+// runs before the next gets a turn (--quantum)
+#define MAX_CORES 64
+#define DEFAULT_QUANTUM 1000
+
+// Reasons for the emulator to stop, also used as the exit code
+#define STOP_HALT 0
+#define STOP_FATAL 1
+#define STOP_BREAK 2
+#define STOP_UNTIL 3
+#define STOP_CYCLES 4
+#define STOP_TIMEOUT 5
+// Not a real stop, the core ran for its quantum (see execute())
+#define STOP_SLICE -1
+
 using namespace std;
 
-void loadIn(unsigned short&,unsigned short&,char*);
+const char* stopNames[] = { "HALT", "FATAL", "BREAK", "UNTIL", "CYCLES", "TIMEOUT" };
+
+/*
+ * Complete state of the emulated CPU.
+ * The ROM is stored decoded, one word per instruction (see TRAP_*).
+ */
+struct Machine {
+	unsigned int code[ROM_SIZE];
+	unsigned short reg[16];
+	// Point at ramData / screenData unless mapped from a file (see mapFile())
+	unsigned char* ram;
+	unsigned char* screen;
+	unsigned char ramData[RAM_SIZE];
+	unsigned char screenData[SCREEN_WIDTH];
+	// Set for each RAM page that may no longer be all zeros, shared like ram
+	unsigned char* ramDirty;
+	unsigned char ramDirtyData[RAM_PAGES];
+	// RAM_* flags for each RAM address with a watchpoint or stop condition
+	unsigned char ramWatch[RAM_SIZE];
+	unsigned char ramUntil[RAM_SIZE];
+	unsigned long long cycle;
+	// Number of times a screen address was written with a new value, counted in
+	// screenCount, which points at screenChanges or at the first core's (see runCores())
+	unsigned long long screenChanges;
+	unsigned long long* screenCount;
+	// Stop conditions, 0 for none
+	unsigned long long maxCycles;
+	unsigned long long screenUntil;
+	double deadline;
+	int clockCheck;
+	// Screen frame stream, NULL if not capturing (see recordFrame())
+	FILE* frames;
+	unsigned char lastFrame[SCREEN_WIDTH];
+	unsigned long long lastFrameCycle;
+	unsigned long long frameEvery;
+	int framePending;
+	// Number of times each ROM address was executed, NULL if not profiling
+	unsigned long long* counts;
+};
+
+/*
+ * Settings for a single run, parsed from the command line or a job request.
+ */
+struct Options {
+	int showScreen;
+	// Skip the per cycle display and delay entirely
+	int quiet;
+	int sleepTime;
+	const char* romPath;
+	// ROM sent along with a job request instead of a path
+	const char* romBytes;
+	size_t romLen;
+	// Breakpoints, watchpoints and conditions are patched in after the ROM is loaded
+	int breaks[MAX_POINTS];
+	int numBreaks;
+	int watches[16];
+	int numWatches;
+	const char* untils[MAX_POINTS];
+	int numUntils;
+	double timeout;
+	const char* pbm;
+	// Print a hash of the final state (see hashState())
+	int hash;
+	// Annotated listing of the ROM to write after the run, NULL for none
+	const char* profile;
+	// Debug map of the ROM's source lines, NULL for none
+	const char* mapPath;
+	// Socket path to serve jobs on, NULL to run a single ROM
+	const char* serve;
+	int workers;
+	// Number of CPUs sharing RAM and the ROM each one runs (the last ROM given
+	// is used for the rest), cycles per turn and whether they run freely on threads
+	int cores;
+	const char* coreRoms[MAX_CORES];
+	int numCoreRoms;
+	unsigned long long quantum;
+	int freeRun;
+};
+
+/*
+ * A core running on its own thread in free running mode (see runCores()).
+ */
+struct CoreThread {
+	Machine* m;
+	unsigned long long quantum;
+	int stop;
+	pthread_t thread;
+};
+
+// Set once any core stops for a reason other than halting
+int coresStopping = 0;
+
+/*
+ * A decoded ROM kept by a job server worker, found by the hash of its bytes.
+ */
+struct CachedRom {
+	unsigned long long hash;
+	unsigned int code[ROM_SIZE];
+};
+
+// Only allocated by job server workers, which see the same ROMs repeatedly
+CachedRom* romCache = NULL;
+int romCacheNext = 0;
+
+/*
+ * Source locations of the ROM, read from a debug map written by asm16 -g.
+ * Each ROM address has the file and line it was assembled from and the
+ * nearest label at or before it, -1 where unknown.
+ */
+struct DebugMap {
+	char** files;
+	int numFiles;
+	char** labels;
+	unsigned short* labelAddrs;
+	int numLabels;
+	int file[ROM_SIZE];
+	int line[ROM_SIZE];
+	int label[ROM_SIZE];
+};
+
+// Only allocated while running a ROM with a debug map
+DebugMap* debugMap = NULL;
+
+void printUsage();
+void resetOptions(Options*);
+void resetMachine(Machine*);
+bool parseArgs(Machine*,Options*,int,char**);
+bool setup(Machine*,Options*);
+bool applyOptions(Machine*,Options*);
+int runCores(Machine*,Options*);
+void* runCoreThread(void*);
+void printCores(Machine**,int,int,int,int);
+void finish(Machine*,Options*,int);
+int serve(Options*);
+void startWorker(int);
+void runJob(Machine*,Options*,int);
+bool loadRom(Machine*,Options*);
+unsigned long long hashBytes(const char*,size_t);
+unsigned char* mapFile(const char*,size_t,int);
+bool loadMap(const char*);
+void freeMap();
+void printSource(unsigned short);
+bool sourceText(unsigned short,char*,size_t);
+void setBreak(Machine*,unsigned short);
+void setRegWatch(Machine*,int);
+bool setUntil(Machine*,const char*);
+void setBlockTraps(Machine*);
+int run(Machine*,int,int,int);
+int execute(Machine*,int,int,int,unsigned long long);
+int handleTrap(Machine*,unsigned int);
+int checkRamWrite(Machine*,unsigned short,unsigned char);
+int checkLimits(Machine*);
+double now();
+void recordFrame(Machine*);
+void writeFrame(Machine*);
+bool writePbm(Machine*,const char*);
+bool writeProfile(Machine*,const char*);
+unsigned long long hashState(Machine*);
+void printHash(Machine*);
+void printReport(Machine*,int,int);
+void printState(Machine*,unsigned int,int);
 void printAll(unsigned short*,int);
-int processIn(unsigned short*,unsigned short);
+int processIn(unsigned short*,unsigned int);
 void printReg(unsigned short);
 void printScreen(unsigned char*,int);
+int parseNum(const char*,int);
+bool parseCount(const char*,unsigned long long*);
+int parseReg(const char*);
 
 /*
  * Main function. Handles all of the Microprocessor emulation.
@@ -44,128 +276,1388 @@ void printScreen(unsigned char*,int);
  */
 int main(int argc,char** argv)
 {
-	int showScreen = 1;
-	// Sleep time (ms) for each clock cycle
-	int sleepTime = 1000;
-	// Each instruction is 2 bytes, so total ROM is ROM_SIZE times 2
-	// Initialize each ROM address to 0 before reading ROM file
-	char rom[ROM_SIZE*2];
-	for(int i=0;i<ROM_SIZE;i++) {
-		rom[i] = 0;
+	Options* opt = new Options();
+	// Zero initializes the ROM, registers, RAM and screen
+	Machine* m = new Machine();
+	resetOptions(opt);
+	resetMachine(m);
+	if(!parseArgs(m,opt,argc,argv)) {
+		return -1;
 	}
-	// Initialize Registers & counter
-	unsigned short in;
-	int cycle;
-	unsigned short reg[16];
-	for(int i=0;i<16;i++) {
-		reg[i] = 0;
+	if(opt->serve) {
+		return serve(opt);
 	}
-	// Initialize all RAM addresses to 0
-	char ram[RAM_SIZE];
-	for(int i=0;i<RAM_SIZE;i++) {
-		ram[i] = 0;
+	if(!opt->romPath) {
+		cout << "No ROM File supplied" << endl;
+		printUsage();
+		return -1;
 	}
-	
-	unsigned char screen[SCREEN_WIDTH];
-	for(int i=0;i<SCREEN_WIDTH;i++) {
-		screen[i] = 0;
+	if(!setup(m,opt)) {
+		return -1;
+	}
+	if(opt->cores > 1) {
+		return runCores(m,opt);
+	}
+	int stop = run(m,opt->quiet,opt->showScreen,opt->sleepTime);
+	finish(m,opt,stop);
+	return stop;
+}
+
+/*
+ * Prints the command line options of the emulator.
+ */
+void printUsage()
+{
+	cout << "Usage:" << endl;
+	cout << "\temu16 -f <file-path> -d <delay> -s -q -b <addr> -w <reg> -m <addr>" << endl;
+	cout << "\t      --max-cycles <n> --timeout <seconds> --until <condition>" << endl;
+	cout << "\t      --ram <file> --ram-shared <file> --screen-shared <file>" << endl;
+	cout << "\t      --frames <file> --frame-every <cycles> --pbm <file> --map <file>" << endl;
+	cout << "\t      --cores <n> --quantum <cycles> --free --hash --profile <file>" << endl;
+	cout << "\temu16 --serve <socket-path> --workers <n>" << endl << endl;
+	cout << "\t -f : Input ROM file path (repeat to give each core its own ROM)" << endl;
+	cout << "\t -d : Optional Delay between emulator clock cycles" << endl;
+	cout << "\t -s : Optional turn off emulator display" << endl;
+	cout << "\t -q : Optional run at full speed, only printing when stopped" << endl;
+	cout << "\t -b : Optional breakpoint on a ROM address (repeatable)" << endl;
+	cout << "\t -w : Optional watchpoint on a register (repeatable)" << endl;
+	cout << "\t -m : Optional watchpoint on a RAM address (repeatable)" << endl;
+	cout << "\t --max-cycles : Optional limit on the number of clock cycles" << endl;
+	cout << "\t --timeout : Optional limit on the running time in seconds" << endl;
+	cout << "\t --until : Optional stop condition pc=<addr>, screen=<changes>" << endl;
+	cout << "\t           or ram[<addr>]=<value> (repeatable)" << endl;
+	cout << "\t --ram : Optional initial RAM image, changes are not saved" << endl;
+	cout << "\t --ram-shared : Optional RAM file, changes are saved to it" << endl;
+	cout << "\t --screen-shared : Optional file the screen is kept in" << endl;
+	cout << "\t --frames : Optional binary stream of screen changes" << endl;
+	cout << "\t --frame-every : Optional minimum cycles between frames" << endl;
+	cout << "\t --pbm : Optional PBM image of the final screen" << endl;
+	cout << "\t --map : Optional debug map from asm16 -g, to show source lines" << endl;
+	cout << "\t --cores : Optional number of CPUs sharing RAM and the screen" << endl;
+	cout << "\t --quantum : Optional cycles each core runs before the next one" << endl;
+	cout << "\t --free : Optional run every core at once on its own thread" << endl;
+	cout << "\t --hash : Optional print a hash of the final registers, RAM, screen and cycle" << endl;
+	cout << "\t --profile : Optional listing of the ROM with how often each instruction ran" << endl;
+	cout << "\t --serve : Run as a job server on a Unix domain socket" << endl;
+	cout << "\t --workers : Optional number of job server worker processes" << endl;
+}
+
+/*
+ * Sets every option back to its default.
+ */
+void resetOptions(Options* opt)
+{
+	memset(opt,0,sizeof(Options));
+	opt->showScreen = 1;
+	// Sleep time (ms) for each clock cycle
+	opt->sleepTime = 1000;
+	opt->cores = 1;
+	opt->quantum = DEFAULT_QUANTUM;
+}
+
+/*
+ * Sets the machine back to its initial, zeroed state.
+ * Any files mapped or opened for a previous run are released.
+ */
+void resetMachine(Machine* m)
+{
+	if(m->ram && m->ram != m->ramData) {
+		munmap(m->ram,RAM_SIZE);
 	}
-	bool hasFile = false;
+	if(m->screen && m->screen != m->screenData) {
+		munmap(m->screen,SCREEN_WIDTH);
+	}
+	if(m->frames) {
+		fclose(m->frames);
+	}
+	delete[] m->counts;
+	// The code array is always overwritten when a ROM is loaded
+	memset(m->reg,0,sizeof(Machine) - offsetof(Machine,reg));
+	m->ram = m->ramData;
+	m->screen = m->screenData;
+	m->ramDirty = m->ramDirtyData;
+	m->screenCount = &m->screenChanges;
+}
+
+/*
+ * Parses command line style arguments into opt. Options which only affect
+ * the machine's memory (RAM watchpoints, mapped files, frame capture) are
+ * applied to m straight away, everything else is applied by setup().
+ *
+ * Returns true if all of the arguments were valid, otherwise false.
+ */
+bool parseArgs(Machine* m,Options* opt,int argc,char** argv)
+{
 	for(int i=1;i<argc;i++) {
 		// Read data from file provided into the ROM memory
 		if(!strcmp(argv[i],"-f")) {
 			if(i+1<argc) {
 				i++;
-				ifstream file;
-				file.open(argv[i]);
-				file.read(rom,ROM_SIZE);
-				file.close();
-				hasFile = true;
+				if(!opt->romPath) {
+					opt->romPath = argv[i];
+				}
+				if(opt->numCoreRoms < MAX_CORES) {
+					opt->coreRoms[opt->numCoreRoms++] = argv[i];
+				}
+			}
+		// ROM data follows a job request instead of being read from a file
+		}else if(!strcmp(argv[i],"--rom-bytes")) {
+			if(i+1<argc) {
+				i++;
+				int len = parseNum(argv[i],ROM_SIZE * 2);
+				if(len < 0) {
+					cout << "Invalid ROM length '" << argv[i] << "'" << endl;
+					return false;
+				}
+				opt->romLen = len;
 			}
 		// Optional argument to change the delay between clock cycles
 		}else if(!strcmp(argv[i],"-d")) {
 			if(i+1<argc) {
 				i++;
-				sleepTime = atoi(argv[i]);
+				opt->sleepTime = atoi(argv[i]);
 			}
 		// Optional argument to hide the emulation screen
 		}else if(!strcmp(argv[i],"-s")) {
-			showScreen = 0;
+			opt->showScreen = 0;
+		// Optional argument to run at full speed without any display
+		}else if(!strcmp(argv[i],"-q")) {
+			opt->quiet = 1;
+		// Optional breakpoint on a ROM address
+		}else if(!strcmp(argv[i],"-b")) {
+			if(i+1<argc) {
+				i++;
+				int addr = parseNum(argv[i],ROM_SIZE - 1);
+				if(addr < 0 || opt->numBreaks >= MAX_POINTS) {
+					cout << "Invalid breakpoint address '" << argv[i] << "'" << endl;
+					return false;
+				}
+				opt->breaks[opt->numBreaks++] = addr;
+			}
+		// Optional watchpoint on a register
+		}else if(!strcmp(argv[i],"-w")) {
+			if(i+1<argc) {
+				i++;
+				int r = parseReg(argv[i]);
+				// The PC changes on every instruction, breakpoints (-b) stop it instead
+				if(r < 0 || r == INPUT || r == PROG_COUNTER) {
+					cout << "Invalid watch register '" << argv[i] << "'" << endl;
+					return false;
+				}
+				if(opt->numWatches < 16) {
+					opt->watches[opt->numWatches++] = r;
+				}
+			}
+		// Optional watchpoint on a RAM address
+		}else if(!strcmp(argv[i],"-m")) {
+			if(i+1<argc) {
+				i++;
+				int addr = parseNum(argv[i],RAM_SIZE - 1);
+				if(addr < 0) {
+					cout << "Invalid RAM watch address '" << argv[i] << "'" << endl;
+					return false;
+				}
+				m->ramWatch[addr] |= RAM_WATCH;
+			}
+		// Optional initial RAM image, mapped copy-on-write so the file is untouched
+		}else if(!strcmp(argv[i],"--ram")) {
+			if(i+1<argc) {
+				i++;
+				if((m->ram = mapFile(argv[i],RAM_SIZE,0)) == NULL) {
+					m->ram = m->ramData;
+					return false;
+				}
+				memset(m->ramDirty,1,RAM_PAGES);
+			}
+		// Optional RAM file mapped shared, so every write persists to the file
+		}else if(!strcmp(argv[i],"--ram-shared")) {
+			if(i+1<argc) {
+				i++;
+				if((m->ram = mapFile(argv[i],RAM_SIZE,1)) == NULL) {
+					m->ram = m->ramData;
+					return false;
+				}
+				memset(m->ramDirty,1,RAM_PAGES);
+			}
+		// Optional screen file mapped shared, for external viewers
+		}else if(!strcmp(argv[i],"--screen-shared")) {
+			if(i+1<argc) {
+				i++;
+				if((m->screen = mapFile(argv[i],SCREEN_WIDTH,1)) == NULL) {
+					m->screen = m->screenData;
+					return false;
+				}
+			}
+		// Optional limit on the number of clock cycles to run
+		}else if(!strcmp(argv[i],"--max-cycles")) {
+			if(i+1<argc) {
+				i++;
+				if(!parseCount(argv[i],&m->maxCycles)) {
+					cout << "Invalid number of cycles '" << argv[i] << "'" << endl;
+					return false;
+				}
+			}
+		// Optional limit on the wall clock time (seconds) to run
+		}else if(!strcmp(argv[i],"--timeout")) {
+			if(i+1<argc) {
+				i++;
+				char* end;
+				opt->timeout = strtod(argv[i],&end);
+				if(*argv[i] == '\0' || *end != '\0' || !(opt->timeout >= 0)) {
+					cout << "Invalid timeout '" << argv[i] << "'" << endl;
+					return false;
+				}
+			}
+		// Optional binary stream of every screen change
+		}else if(!strcmp(argv[i],"--frames")) {
+			if(i+1<argc) {
+				i++;
+				if((m->frames = fopen(argv[i],"wb")) == NULL) {
+					cout << "Unable to open frame file '" << argv[i] << "'" << endl;
+					return false;
+				}
+				fwrite(FRAME_MAGIC,1,strlen(FRAME_MAGIC),m->frames);
+			}
+		// Optional minimum number of cycles between captured frames
+		}else if(!strcmp(argv[i],"--frame-every")) {
+			if(i+1<argc) {
+				i++;
+				m->frameEvery = strtoull(argv[i],NULL,0);
+			}
+		// Optional PBM image of the final screen
+		}else if(!strcmp(argv[i],"--pbm")) {
+			if(i+1<argc) {
+				i++;
+				opt->pbm = argv[i];
+			}
+		// Optional debug map, loaded by setup()
+		}else if(!strcmp(argv[i],"--map")) {
+			if(i+1<argc) {
+				i++;
+				opt->mapPath = argv[i];
+			}
+		// Optional condition to stop at, applied once the ROM is loaded
+		}else if(!strcmp(argv[i],"--until")) {
+			if(i+1<argc) {
+				i++;
+				if(opt->numUntils >= MAX_POINTS) {
+					cout << "Too many stop conditions" << endl;
+					return false;
+				}
+				opt->untils[opt->numUntils++] = argv[i];
+			}
+		// Run as a job server on the given socket instead of running a ROM
+		}else if(!strcmp(argv[i],"--serve")) {
+			if(i+1<argc) {
+				i++;
+				opt->serve = argv[i];
+			}
+		// Optional number of job server workers
+		}else if(!strcmp(argv[i],"--workers")) {
+			if(i+1<argc) {
+				i++;
+				opt->workers = atoi(argv[i]);
+			}
+		// Optional number of CPUs sharing RAM
+		}else if(!strcmp(argv[i],"--cores")) {
+			if(i+1<argc) {
+				i++;
+				opt->cores = atoi(argv[i]);
+				if(opt->cores < 1 || opt->cores > MAX_CORES) {
+					cout << "Number of cores must be between 1 and " << MAX_CORES << endl;
+					return false;
+				}
+			}
+		// Optional cycles each core runs before the next gets a turn
+		}else if(!strcmp(argv[i],"--quantum")) {
+			if(i+1<argc) {
+				i++;
+				opt->quantum = strtoull(argv[i],NULL,0);
+				if(!opt->quantum) {
+					opt->quantum = DEFAULT_QUANTUM;
+				}
+			}
+		// Optional run every core at once instead of taking turns
+		}else if(!strcmp(argv[i],"--free")) {
+			opt->freeRun = 1;
+		// Optional hash of the final state, for golden tests
+		}else if(!strcmp(argv[i],"--hash")) {
+			opt->hash = 1;
+		// Optional listing annotated with execution counts
+		}else if(!strcmp(argv[i],"--profile")) {
+			if(i+1<argc) {
+				i++;
+				opt->profile = argv[i];
+			}
 		}
 	}
-	if(!hasFile) {
-		cout << "No ROM File supplied" << endl;
-		cout << "Usage:" << endl;
-		cout << "\temu16 -f <file-path> -d <delay> -s" << endl << endl;
-		cout << "\t -f : Input ROM file path" << endl;
-		cout << "\t -d : Optional Delay between emulator clock cycles" << endl;
-		cout << "\t -s : Optional turn off emulator display" << endl;
+	return true;
+}
+
+/*
+ * Loads the ROM and patches in the breakpoints, watchpoints and stop
+ * conditions from opt.
+ *
+ * Returns true if the machine is ready to run, otherwise false.
+ */
+bool setup(Machine* m,Options* opt)
+{
+	if(!loadRom(m,opt)) {
+		cout << "Unable to open ROM file '" << (opt->romPath ? opt->romPath : "") << "'" << endl;
+		return false;
+	}
+	freeMap();
+	if(opt->mapPath && !loadMap(opt->mapPath)) {
+		cout << "Unable to read debug map '" << opt->mapPath << "'" << endl;
+		return false;
+	}
+	if(opt->profile) {
+		m->counts = new unsigned long long[ROM_SIZE]();
+		for(int i=0;i<ROM_SIZE;i++) {
+			m->code[i] |= TRAP_COUNT;
+		}
+	}
+	return applyOptions(m,opt);
+}
+
+/*
+ * Patches the breakpoints, watchpoints and stop conditions from opt into
+ * the loaded ROM and starts the timeout.
+ *
+ * Returns true if every stop condition was valid, otherwise false.
+ */
+bool applyOptions(Machine* m,Options* opt)
+{
+	for(int i=0;i<opt->numBreaks;i++) {
+		setBreak(m,opt->breaks[i]);
+	}
+	for(int i=0;i<opt->numWatches;i++) {
+		setRegWatch(m,opt->watches[i]);
+	}
+	for(int i=0;i<opt->numUntils;i++) {
+		if(!setUntil(m,opt->untils[i])) {
+			cout << "Invalid stop condition '" << opt->untils[i] << "'" << endl;
+			return false;
+		}
+	}
+	if(opt->timeout > 0) {
+		m->deadline = now() + opt->timeout;
+	}
+	if(m->maxCycles || m->deadline) {
+		setBlockTraps(m);
+	}
+	return true;
+}
+
+/*
+ * Runs several CPUs, each with its own registers and ROM, sharing the RAM and
+ * screen of m. Every core gets the same breakpoints and stop conditions, and
+ * cycle limits count each core's own cycles. By default the cores take turns of
+ * opt->quantum cycles on this thread, in order, so every run is the same. With
+ * --free, each core runs on its own thread and the cores only look at each other
+ * between turns, to stop together.
+ * The machine stops once every core halts, or as soon as any core stops for
+ * another reason.
+ *
+ * Returns the reason the machine stopped (one of STOP_*).
+ */
+int runCores(Machine* m,Options* opt)
+{
+	Machine* cores[MAX_CORES];
+	int n = opt->cores, stop = STOP_HALT, stopCore = 0;
+	if(m->frames || m->counts) {
+		cout << "Frame capture and profiling only work with a single core" << endl;
 		return -1;
 	}
-	cycle = 1;
+	cores[0] = m;
+	const char* romPath = opt->romPath;
+	for(int i=1;i<n;i++) {
+		cores[i] = new Machine();
+		// The extra cores are freed without resetMachine(), which would unmap the shared RAM
+		resetMachine(cores[i]);
+		cores[i]->ram = m->ram;
+		cores[i]->ramDirty = m->ramDirty;
+		cores[i]->screen = m->screen;
+		cores[i]->screenCount = m->screenCount;
+		cores[i]->maxCycles = m->maxCycles;
+		memcpy(cores[i]->ramWatch,m->ramWatch,sizeof(m->ramWatch));
+		memcpy(cores[i]->ramUntil,m->ramUntil,sizeof(m->ramUntil));
+		// Jobs sending the ROM bytes run them on every core
+		if(opt->numCoreRoms > 0) {
+			opt->romPath = opt->coreRoms[(i < opt->numCoreRoms) ? i : opt->numCoreRoms - 1];
+		}
+		if(!loadRom(cores[i],opt) || !applyOptions(cores[i],opt)) {
+			cout << "Unable to open ROM file '" << (opt->romPath ? opt->romPath : "") << "'" << endl;
+			opt->romPath = romPath;
+			for(int j=1;j<=i;j++) {
+				delete cores[j];
+			}
+			return -1;
+		}
+	}
+	opt->romPath = romPath;
+	for(int i=0;i<n;i++) {
+		cores[i]->cycle = 1;
+		cores[i]->clockCheck = CLOCK_CHECK;
+	}
+	if(opt->freeRun) {
+		CoreThread threads[MAX_CORES];
+		coresStopping = 0;
+		for(int i=0;i<n;i++) {
+			threads[i].m = cores[i];
+			threads[i].quantum = opt->quantum;
+			threads[i].stop = STOP_HALT;
+			pthread_create(&threads[i].thread,NULL,runCoreThread,&threads[i]);
+		}
+		for(int i=0;i<n;i++) {
+			pthread_join(threads[i].thread,NULL);
+			if(!stop && threads[i].stop != STOP_HALT && threads[i].stop != STOP_SLICE) {
+				stop = threads[i].stop;
+				stopCore = i;
+			}
+		}
+	}else {
+		int running = n;
+		bool halted[MAX_CORES] = { false };
+		while(running > 0 && !stop) {
+			for(int i=0;i<n && !stop;i++) {
+				if(halted[i]) {
+					continue;
+				}
+				int r = execute(cores[i],1,0,0,cores[i]->cycle + opt->quantum - 1);
+				if(r == STOP_HALT) {
+					halted[i] = true;
+					running--;
+				}else if(r != STOP_SLICE) {
+					stop = r;
+					stopCore = i;
+				}
+			}
+		}
+	}
+	printCores(cores,n,stop,stopCore,opt->showScreen);
+	for(int i=0;i<n && opt->hash;i++) {
+		printHash(cores[i]);
+	}
+	if(opt->pbm && !writePbm(m,opt->pbm)) {
+		cout << "Unable to write PBM file '" << opt->pbm << "'" << endl;
+	}
+	for(int i=1;i<n;i++) {
+		delete cores[i];
+	}
+	return stop;
+}
+
+/*
+ * Runs a core in turns of its quantum until it stops, or another core stops.
+ */
+void* runCoreThread(void* arg)
+{
+	CoreThread* core = (CoreThread*) arg;
+	while(!__atomic_load_n(&coresStopping,__ATOMIC_RELAXED)) {
+		core->stop = execute(core->m,1,0,0,core->m->cycle + core->quantum - 1);
+		if(core->stop != STOP_SLICE) {
+			break;
+		}
+	}
+	if(core->stop != STOP_HALT && core->stop != STOP_SLICE) {
+		__atomic_store_n(&coresStopping,1,__ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/*
+ * Prints the final report for several cores: why they stopped, the state of
+ * each core and the shared screen.
+ */
+void printCores(Machine** cores,int n,int stop,int stopCore,int showScreen)
+{
+	cout << "STOPPED: " << stopNames[stop];
+	if(stop != STOP_HALT) {
+		cout << " (CORE " << stopCore << ")";
+	}
+	cout << endl;
+	cout << "SCREEN CHANGES: " << *cores[0]->screenCount << endl;
+	for(int i=0;i<n;i++) {
+		unsigned short pc = cores[i]->reg[PROG_COUNTER];
+		cout << endl << "---------------- CORE " << i << " -----------------" << endl << endl;
+		printState(cores[i],(pc < ROM_SIZE) ? cores[i]->code[pc] : 0,0);
+	}
+	if(showScreen) {
+		cout << endl << "---------------- SCREEN -----------------" << endl << endl;
+		printScreen(cores[0]->screen,SCREEN_WIDTH);
+	}
+}
+
+/*
+ * Prints the final report for a run and writes out any captured output.
+ */
+void finish(Machine* m,Options* opt,int stop)
+{
+	printReport(m,stop,opt->showScreen);
+	if(opt->hash) {
+		printHash(m);
+	}
+	if(m->frames) {
+		// The last sampled change is always kept
+		if(m->framePending) {
+			writeFrame(m);
+		}
+		fclose(m->frames);
+		m->frames = NULL;
+	}
+	if(opt->pbm && !writePbm(m,opt->pbm)) {
+		cout << "Unable to write PBM file '" << opt->pbm << "'" << endl;
+	}
+	if(opt->profile && !writeProfile(m,opt->profile)) {
+		cout << "Unable to write profile '" << opt->profile << "'" << endl;
+	}
+}
+
+/*
+ * Runs a job server on a Unix domain socket at path. A pool of worker
+ * processes is forked up front, each with its own machine and ROM cache,
+ * and each accepts jobs from the socket directly. A job is a single line
+ * of the same arguments as the command line, for example:
+ *
+ * 	-f rom.file --max-cycles 100000 --until pc=0x20
+ * 	--rom-bytes 6 --timeout 2
+ *
+ * With --rom-bytes, the raw ROM follows straight after the newline.
+ * The final report is written back to the client and the connection closed.
+ * Jobs can name any file to read or write, so the socket is only open to
+ * the user running the server.
+ */
+int serve(Options* opt)
+{
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(opt->serve) >= sizeof(addr.sun_path)) {
+		cout << "Socket path '" << opt->serve << "' is too long" << endl;
+		return -1;
+	}
+	strcpy(addr.sun_path,opt->serve);
+	int fd = socket(AF_UNIX,SOCK_STREAM,0);
+	unlink(opt->serve);
+	// Jobs can write any file the server can (--ram-shared, --pbm and so on),
+	// so the socket is created for the user running the server only
+	mode_t mask = umask(077);
+	int bound = (fd >= 0) ? bind(fd,(struct sockaddr*) &addr,sizeof(addr)) : -1;
+	umask(mask);
+	struct stat st;
+	if(bound || stat(opt->serve,&st) || (st.st_mode & 077)) {
+		cout << "Unable to create a private socket at '" << opt->serve << "'" << endl;
+		return -1;
+	}
+	if(listen(fd,SOMAXCONN)) {
+		cout << "Unable to listen on '" << opt->serve << "'" << endl;
+		return -1;
+	}
+	// Clients that hang up early should not kill their worker
+	signal(SIGPIPE,SIG_IGN);
+	int workers = (opt->workers > 0) ? opt->workers : sysconf(_SC_NPROCESSORS_ONLN);
+	cout << "Serving jobs on " << opt->serve << " with " << workers << " workers" << endl;
+	for(int i=0;i<workers;i++) {
+		startWorker(fd);
+	}
+	// Replace any worker that dies
+	for(;;) {
+		if(wait(NULL) > 0) {
+			startWorker(fd);
+		}else if(errno != EINTR) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Forks a job server worker, which keeps accepting jobs from the
+ * listening socket fd until it is killed.
+ */
+void startWorker(int fd)
+{
+	cout.flush();
+	if(fork()) {
+		return;
+	}
+	Options* opt = new Options();
+	Machine* m = new Machine();
+	romCache = new CachedRom[ROM_CACHE_SIZE]();
+	for(;;) {
+		int conn = accept(fd,NULL,NULL);
+		if(conn >= 0) {
+			runJob(m,opt,conn);
+			close(conn);
+		}
+	}
+}
+
+/*
+ * Reads a job request from conn, runs it and writes the report back to conn.
+ */
+void runJob(Machine* m,Options* opt,int conn)
+{
+	static char req[ROM_SIZE * 2 + 4096];
+	static char* args[MAX_POINTS * 2 + 64];
+	size_t len = 0;
+	char* end = NULL;
+	// Read until the end of the request line
+	while(end == NULL && len < sizeof(req) - ROM_SIZE * 2 - 1) {
+		ssize_t n = read(conn,req + len,sizeof(req) - ROM_SIZE * 2 - 1 - len);
+		if(n <= 0) {
+			return;
+		}
+		end = (char*) memchr(req + len,'\n',n);
+		len += n;
+	}
+	if(end == NULL) {
+		return;
+	}
+	*end = '\0';
+	char* data = end + 1;
+	size_t dataLen = len - (data - req);
+	int argc = 1;
+	for(char* tok = strtok(req," \t\r");tok != NULL && argc < (int) (sizeof(args) / sizeof(char*));tok = strtok(NULL," \t\r")) {
+		args[argc++] = tok;
+	}
+	// Everything printed for the job goes back to the client
+	cout.flush();
+	int out = dup(STDOUT_FILENO);
+	dup2(conn,STDOUT_FILENO);
+	resetMachine(m);
+	resetOptions(opt);
+	if(parseArgs(m,opt,argc,args)) {
+		// Jobs always run at full speed, whatever the request says
+		opt->quiet = 1;
+		if(opt->romLen) {
+			while(dataLen < opt->romLen) {
+				ssize_t n = read(conn,data + dataLen,opt->romLen - dataLen);
+				if(n <= 0) {
+					break;
+				}
+				dataLen += n;
+			}
+			opt->romBytes = data;
+			opt->romLen = (dataLen < opt->romLen) ? dataLen : opt->romLen;
+		}
+		if(!opt->romPath && !opt->romBytes) {
+			cout << "No ROM File supplied" << endl;
+		}else if(!setup(m,opt)) {
+			// setup() has already said what was wrong
+		}else if(opt->cores > 1) {
+			runCores(m,opt);
+		}else {
+			finish(m,opt,run(m,1,opt->showScreen,0));
+		}
+	}
+	cout.flush();
+	dup2(out,STDOUT_FILENO);
+	close(out);
+}
+
+/*
+ * Runs the machine from its current state until it stops.
+ * Every clock cycle is printed and delayed by sleepTime unless quiet is set.
+ *
+ * Returns the reason the machine stopped (one of STOP_*).
+ */
+int run(Machine* m,int quiet,int showScreen,int sleepTime)
+{
+	m->cycle = 1;
+	m->clockCheck = CLOCK_CHECK;
+	return execute(m,quiet,showScreen,sleepTime,ULLONG_MAX);
+}
+
+/*
+ * Executes instructions until the machine stops, or until clock cycle end
+ * is done. RAM and the screen may be shared with cores running on other
+ * threads (see runCores()), so every access is a single atomic byte load or
+ * store, which costs the same as a plain one.
+ *
+ * Returns the reason the machine stopped (one of STOP_*), or STOP_SLICE if
+ * it reached cycle end.
+ */
+int execute(Machine* m,int quiet,int showScreen,int sleepTime,unsigned long long end)
+{
+	unsigned short* reg = m->reg;
+	unsigned char* ram = m->ram;
+	unsigned char* screen = m->screen;
+	unsigned int in;
+	int stop = STOP_HALT;
 	// Continue executing until the counter exceeds total ROM size.
 	while(reg[PROG_COUNTER] < ROM_SIZE) {
-		loadIn(reg[PROG_COUNTER],in,rom);
+		in = m->code[reg[PROG_COUNTER]];
 		// If we're reading from RAM or Screen, we load the value into the input register
 		if(!(reg[OUTPUT1] & 0x8000)) {
 			reg[INPUT] &= 0xFF00;
 			if(reg[OUTPUT1] & 0x4000) {
-				reg[INPUT] |= (0xFF & screen[0xF & reg[OUTPUT2]]);
+				reg[INPUT] |= (0xFF & __atomic_load_n(&screen[0xF & reg[OUTPUT2]],__ATOMIC_RELAXED));
 			}else {
-				reg[INPUT] |= (0xFF & ram[reg[OUTPUT2]]);
+				reg[INPUT] |= (0xFF & __atomic_load_n(&ram[reg[OUTPUT2]],__ATOMIC_RELAXED));
 			}
 		}
 		if(processIn(reg,in)) { // If processIn returns a non-zero number, something went wrong >.<
-			cout << "FATAL ERROR - ";
-			printReg(in);
-			cout << endl;
-			return 1;
+			// Unless it was a debugging trap patched into the ROM
+			if(!(in & ~INSTR_MASK)) {
+				cout << "FATAL ERROR - ";
+				printReg(in);
+				printSource(reg[PROG_COUNTER]);
+				cout << endl;
+				return STOP_FATAL;
+			}
+			if((stop = handleTrap(m,in))) {
+				return stop;
+			}
 		}
 		// Write value to RAM or Screen if flag is on
 		if(reg[OUTPUT1] & 0x8000) {
+			unsigned char val = (0xFF & reg[OUTPUT1]);
 			if(reg[OUTPUT1] & 0x4000) {
-				screen[0xF & reg[OUTPUT2]] = (0xFF & reg[OUTPUT1]);
+				// Only the core whose write changed the byte counts it
+				if(__atomic_load_n(&screen[0xF & reg[OUTPUT2]],__ATOMIC_RELAXED) != val
+					&& __atomic_exchange_n(&screen[0xF & reg[OUTPUT2]],val,__ATOMIC_RELAXED) != val) {
+					if(m->frames) {
+						recordFrame(m);
+					}
+					unsigned long long changes = __atomic_add_fetch(m->screenCount,1,__ATOMIC_RELAXED);
+					if(changes == m->screenUntil) {
+						cout << "UNTIL - screen changed " << changes << " times" << endl << endl;
+						return STOP_UNTIL;
+					}
+				}
 			}else {
-				ram[reg[OUTPUT2]] = (0xFF & reg[OUTPUT1]);
+				// Watchpoints and conditions are only checked here, on the write path
+				if(m->ramWatch[reg[OUTPUT2]]) {
+					if((stop = checkRamWrite(m,reg[OUTPUT2],val))) {
+						return stop;
+					}
+				}
+				__atomic_store_n(&ram[reg[OUTPUT2]],val,__ATOMIC_RELAXED);
+				__atomic_store_n(&m->ramDirty[reg[OUTPUT2] >> RAM_PAGE_BITS],1,__ATOMIC_RELAXED);
 			}
 		}
-		// Print emulator information
-		cout << "CLOCK CYCLE: " << cycle << endl;
-		cout << "    COUNTER: ";
-		printReg(reg[PROG_COUNTER]);
-		cout << endl;
-		cout << "INSTRUCTION: ";
-		printReg(in);
-		cout << endl << endl;
-		// Print all of the emulator registers
-		cout << "--------------- REGISTERS ---------------" << endl << endl;
-		printAll(reg,16);
-		// Print the emulated display if option is allowed
-		if(showScreen) {
-			cout << endl << "---------------- SCREEN -----------------" << endl << endl;
-			printScreen(screen,SCREEN_WIDTH);
+		if(!quiet) {
+			printState(m,in,showScreen);
 		}
 		// Sleep, clear the console, and increment the clock cycle
 		// if there will be another instruction to process
 		if(reg[PROG_COUNTER] < ROM_SIZE) {
-			usleep(sleepTime * 1000);
-			system("clear");
-			cycle++;
+			if(!quiet) {
+				usleep(sleepTime * 1000);
+				system("clear");
+			}
+			if(++m->cycle > end) {
+				return STOP_SLICE;
+			}
+		}
+	}
+	return STOP_HALT;
+}
+
+/*
+ * Reads the ROM file (or the bytes sent with a job) and decodes it into the
+ * machine's code array. Each pair of bytes is a single big endian instruction.
+ * Job server workers keep recently decoded ROMs, found by their hash.
+ *
+ * Returns true if the ROM could be read, otherwise false.
+ */
+bool loadRom(Machine* m,Options* opt)
+{
+	// Each instruction is 2 bytes, so total ROM is ROM_SIZE times 2
+	static char rom[ROM_SIZE*2];
+	size_t len;
+	memset(rom,0,sizeof(rom));
+	if(opt->romBytes) {
+		len = (opt->romLen < sizeof(rom)) ? opt->romLen : sizeof(rom);
+		memcpy(rom,opt->romBytes,len);
+	}else {
+		ifstream file;
+		file.open(opt->romPath,ios::in | ios::binary);
+		if(!file.is_open()) {
+			return false;
+		}
+		file.read(rom,sizeof(rom));
+		len = file.gcount();
+		file.close();
+	}
+	unsigned long long hash = 0;
+	if(romCache) {
+		hash = hashBytes(rom,len);
+		for(int i=0;i<ROM_CACHE_SIZE;i++) {
+			if(romCache[i].hash == hash) {
+				memcpy(m->code,romCache[i].code,sizeof(m->code));
+				return true;
+			}
+		}
+	}
+	for(int i=0;i<ROM_SIZE;i++) {
+		m->code[i] = ((rom[i * 2] & 0xFF) << 8) | (rom[i * 2 + 1] & 0xFF);
+	}
+	if(romCache) {
+		romCache[romCacheNext].hash = hash;
+		memcpy(romCache[romCacheNext].code,m->code,sizeof(m->code));
+		romCacheNext = (romCacheNext + 1) % ROM_CACHE_SIZE;
+	}
+	return true;
+}
+
+/*
+ * Reads a debug map written by asm16 -g. After the MAP_MAGIC line, each line is
+ * F <number> <path> for a source file, L <address> <name> for a label,
+ * S <address> <file> <line> for the start of a source line's code and
+ * E <address> for the end of the program. Addresses are hexadecimal.
+ *
+ * Returns true if the map could be read, otherwise false.
+ */
+bool loadMap(const char* path)
+{
+	char buf[4096];
+	FILE* fp = fopen(path,"r");
+	if(!fp) {
+		return false;
+	}
+	if(!fgets(buf,sizeof(buf),fp) || strncmp(buf,MAP_MAGIC,strlen(MAP_MAGIC))) {
+		fclose(fp);
+		return false;
+	}
+	DebugMap* map = new DebugMap();
+	memset(map->file,-1,sizeof(map->file));
+	memset(map->label,-1,sizeof(map->label));
+	unsigned int addr, end = ROM_SIZE;
+	int num, line, pos;
+	bool valid = true;
+	while(valid && fgets(buf,sizeof(buf),fp)) {
+		buf[strcspn(buf,"\n")] = '\0';
+		if(sscanf(buf,"F %d %n",&num,&pos) == 1 && num == map->numFiles) {
+			map->files = (char**) realloc(map->files,(map->numFiles + 1) * sizeof(char*));
+			map->files[map->numFiles++] = strdup(buf + pos);
+		}else if(sscanf(buf,"L %x %n",&addr,&pos) == 1 && addr < ROM_SIZE) {
+			map->labels = (char**) realloc(map->labels,(map->numLabels + 1) * sizeof(char*));
+			map->labelAddrs = (unsigned short*) realloc(map->labelAddrs,(map->numLabels + 1) * sizeof(unsigned short));
+			map->labels[map->numLabels] = strdup(buf + pos);
+			map->labelAddrs[map->numLabels] = addr;
+			map->label[addr] = map->numLabels++;
+		}else if(sscanf(buf,"S %x %d %d",&addr,&num,&line) == 3 && addr < ROM_SIZE && num < map->numFiles) {
+			map->file[addr] = num;
+			map->line[addr] = line;
+		}else if(sscanf(buf,"E %x",&addr) == 1) {
+			end = (addr < ROM_SIZE) ? addr : ROM_SIZE;
+		}else {
+			valid = false;
+		}
+	}
+	fclose(fp);
+	// Each source line and label covers every address up to the next one
+	for(unsigned int i=1;i<end;i++) {
+		if(map->file[i] < 0) {
+			map->file[i] = map->file[i - 1];
+			map->line[i] = map->line[i - 1];
+		}
+		if(map->label[i] < 0) {
+			map->label[i] = map->label[i - 1];
+		}
+	}
+	debugMap = map;
+	if(!valid) {
+		freeMap();
+	}
+	return valid;
+}
+
+/*
+ * Releases the debug map of the last ROM, if there was one.
+ */
+void freeMap()
+{
+	if(!debugMap) {
+		return;
+	}
+	for(int i=0;i<debugMap->numFiles;i++) {
+		free(debugMap->files[i]);
+	}
+	for(int i=0;i<debugMap->numLabels;i++) {
+		free(debugMap->labels[i]);
+	}
+	free(debugMap->files);
+	free(debugMap->labels);
+	free(debugMap->labelAddrs);
+	delete debugMap;
+	debugMap = NULL;
+}
+
+/*
+ * Prints the source file, line and label a ROM address was assembled from
+ * to cout, if there is a debug map, for example " (main.asm line 12, loop+2)".
+ */
+void printSource(unsigned short addr)
+{
+	char text[PATH_MAX + 64];
+	if(sourceText(addr,text,sizeof(text))) {
+		cout << " (" << text << ")";
+	}
+}
+
+/*
+ * Writes where addr came from in the source into text, such as "prog.asm line 12, loop+2".
+ *
+ * Returns true if the debug map has addr, otherwise false.
+ */
+bool sourceText(unsigned short addr,char* text,size_t size)
+{
+	if(!debugMap || addr >= ROM_SIZE || debugMap->file[addr] < 0) {
+		return false;
+	}
+	int len = snprintf(text,size,"%s line %d",debugMap->files[debugMap->file[addr]],debugMap->line[addr]);
+	int label = debugMap->label[addr];
+	if(label >= 0 && len >= 0 && (size_t) len < size) {
+		len += snprintf(text + len,size - len,", %s",debugMap->labels[label]);
+		if(addr != debugMap->labelAddrs[label] && (size_t) len < size) {
+			snprintf(text + len,size - len,"+%d",addr - debugMap->labelAddrs[label]);
+		}
+	}
+	return true;
+}
+
+/*
+ * Returns the 64 bit FNV-1a hash of len bytes of data.
+ */
+unsigned long long hashBytes(const char* data,size_t len)
+{
+	unsigned long long hash = 0xCBF29CE484222325ULL;
+	for(size_t i=0;i<len;i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Hashes the registers, RAM, screen and clock cycle of m, so two runs can be
+ * compared without keeping their whole state. RAM is hashed a page at a time
+ * and the page hashes are hashed with everything else. Pages that were never
+ * written are still zero, so their hash is worked out once instead of reading
+ * them, and a short run only reads the few pages it touched.
+ *
+ * Returns the 64 bit hash of the machine state.
+ */
+unsigned long long hashState(Machine* m)
+{
+	static unsigned long long zeroPage = 0;
+	unsigned char state[32 + 8 + SCREEN_WIDTH + 8 * RAM_PAGES];
+	unsigned char* p = state;
+	if(!zeroPage) {
+		char zeros[1 << RAM_PAGE_BITS] = { 0 };
+		zeroPage = hashBytes(zeros,sizeof(zeros));
+	}
+	// Numbers are stored high byte first so the hash is the same on any host
+	for(int i=0;i<16;i++) {
+		*p++ = m->reg[i] >> 8;
+		*p++ = m->reg[i];
+	}
+	for(int i=56;i>=0;i-=8) {
+		*p++ = m->cycle >> i;
+	}
+	memcpy(p,m->screen,SCREEN_WIDTH);
+	p += SCREEN_WIDTH;
+	for(int i=0;i<RAM_PAGES;i++) {
+		unsigned long long page = zeroPage;
+		if(m->ramDirty[i]) {
+			page = hashBytes((char*) &m->ram[i << RAM_PAGE_BITS],1 << RAM_PAGE_BITS);
+		}
+		for(int j=56;j>=0;j-=8) {
+			*p++ = page >> j;
+		}
+	}
+	return hashBytes((char*) state,sizeof(state));
+}
+
+/*
+ * Prints the hash of the final state of m (see hashState()).
+ */
+void printHash(Machine* m)
+{
+	char buf[32];
+	snprintf(buf,sizeof(buf),"%016llx",hashState(m));
+	cout << "STATE HASH: " << buf << endl;
+}
+
+/*
+ * Maps size bytes of the file at path into memory.
+ * Shared mappings write straight through to the file, which is created and
+ * grown to size if needed. Private mappings are copy-on-write and leave the
+ * file untouched; anything past the end of a short file reads as 0.
+ *
+ * Returns a pointer to the mapped memory, or NULL if it could not be mapped.
+ */
+unsigned char* mapFile(const char* path,size_t size,int shared)
+{
+	int fd = open(path,shared ? (O_RDWR | O_CREAT) : O_RDONLY,0644);
+	struct stat st;
+	if(fd < 0 || fstat(fd,&st)) {
+		cout << "Unable to open '" << path << "'" << endl;
+		return NULL;
+	}
+	void* mem;
+	if(shared) {
+		if(st.st_size < (off_t) size && ftruncate(fd,size)) {
+			cout << "Unable to resize '" << path << "'" << endl;
+			close(fd);
+			return NULL;
+		}
+		mem = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	}else {
+		// Reserve zeroed memory for the whole size, then map the file over
+		// the start of it. Pages past the end of the file stay anonymous.
+		mem = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+		size_t len = ((size_t) st.st_size < size) ? st.st_size : size;
+		if(mem != MAP_FAILED && len > 0 &&
+			mmap(mem,len,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_FIXED,fd,0) == MAP_FAILED) {
+			munmap(mem,size);
+			mem = MAP_FAILED;
+		}
+	}
+	close(fd);
+	if(mem == MAP_FAILED) {
+		cout << "Unable to map '" << path << "'" << endl;
+		return NULL;
+	}
+	return (unsigned char*) mem;
+}
+
+/*
+ * Patches a breakpoint into the instruction at addr.
+ * The instruction is not executed when the breakpoint is hit.
+ */
+void setBreak(Machine* m,unsigned short addr)
+{
+	m->code[addr] |= TRAP_BREAK;
+}
+
+/*
+ * Patches a watchpoint trap into every instruction that writes to register r.
+ * Only those instructions pay for checking the register afterwards.
+ */
+void setRegWatch(Machine* m,int r)
+{
+	for(int i=0;i<ROM_SIZE;i++) {
+		if(((m->code[i] & 0x0F00) >> 8) == r) {
+			m->code[i] |= TRAP_WATCH;
+		}
+	}
+}
+
+/*
+ * Patches a stop condition into the machine. Conditions are:
+ * 	pc=<addr>         : the PC reaches addr
+ * 	screen=<changes>  : the screen has been changed that many times
+ * 	ram[<addr>]=<val> : RAM address addr is written with val
+ *
+ * Returns true if the condition could be parsed, otherwise false.
+ */
+bool setUntil(Machine* m,const char* cond)
+{
+	char buf[64];
+	const char* eq = strchr(cond,'=');
+	if(eq == NULL || eq - cond >= (int) sizeof(buf)) {
+		return false;
+	}
+	strncpy(buf,cond,eq - cond);
+	buf[eq - cond] = '\0';
+	if(!strcasecmp(buf,"pc")) {
+		int addr = parseNum(eq + 1,ROM_SIZE - 1);
+		if(addr < 0) {
+			return false;
 		}
+		m->code[addr] |= TRAP_UNTIL;
+		return true;
+	}
+	if(!strcasecmp(buf,"screen")) {
+		int changes = parseNum(eq + 1,0x7FFFFFFF);
+		if(changes <= 0) {
+			return false;
+		}
+		m->screenUntil = changes;
+		return true;
+	}
+	int len = strlen(buf);
+	if(!strncasecmp(buf,"ram[",4) && buf[len - 1] == ']') {
+		buf[len - 1] = '\0';
+		int addr = parseNum(&buf[4],RAM_SIZE - 1);
+		int val = parseNum(eq + 1,255);
+		if(addr < 0 || val < 0) {
+			return false;
+		}
+		m->ramWatch[addr] |= RAM_UNTIL;
+		m->ramUntil[addr] = val;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Patches a limit check into every instruction that writes the PC.
+ * Any endless loop has to pass through one of them.
+ */
+void setBlockTraps(Machine* m)
+{
+	for(int i=0;i<ROM_SIZE;i++) {
+		if(((m->code[i] & 0x0F00) >> 8) == PROG_COUNTER) {
+			m->code[i] |= TRAP_BLOCK;
+		}
+	}
+}
+
+/*
+ * Handles an instruction which had a debugging trap patched into it.
+ * Profiled instructions are counted first. Unless a trap stops the machine,
+ * the instruction is executed and watched instructions are compared against
+ * the previous value of their destination register.
+ *
+ * Returns the reason to stop (one of STOP_*), or 0 to keep running.
+ */
+int handleTrap(Machine* m,unsigned int in)
+{
+	if(in & TRAP_COUNT) {
+		m->counts[m->reg[PROG_COUNTER]]++;
+	}
+	if(in & TRAP_BREAK) {
+		cout << "BREAKPOINT - ";
+		printReg(m->reg[PROG_COUNTER]);
+		printSource(m->reg[PROG_COUNTER]);
+		cout << endl << endl;
+		return STOP_BREAK;
+	}
+	if(in & TRAP_UNTIL) {
+		cout << "UNTIL - PC reached ";
+		printReg(m->reg[PROG_COUNTER]);
+		printSource(m->reg[PROG_COUNTER]);
+		cout << endl << endl;
+		return STOP_UNTIL;
+	}
+	if(in & TRAP_BLOCK) {
+		int stop = checkLimits(m);
+		if(stop) {
+			return stop;
+		}
+	}
+	int regD = (in & 0x0F00) >> 8;
+	unsigned short before = m->reg[regD];
+	unsigned short addr = m->reg[PROG_COUNTER];
+	processIn(m->reg,in & INSTR_MASK);
+	if((in & TRAP_WATCH) && m->reg[regD] != before) {
+		cout << "WATCHPOINT - r" << regD << " changed from " << before << " to "
+			<< m->reg[regD] << " at ";
+		printReg(addr);
+		printSource(addr);
+		cout << endl << endl;
+		return STOP_BREAK;
 	}
 	return 0;
 }
 
 /*
- * Loads the next instruction into the variable address &in.
- * Increments &counter by the number of bytes read from rom into &in.
- * (Increments by 2)
+ * Checks a write of val to a RAM address flagged in Machine::ramWatch.
+ * The value is only written if the machine is stopping.
+ *
+ * Returns the reason to stop (one of STOP_*), or 0 to keep running.
  */
-void loadIn(unsigned short &counter,unsigned short &in, char* rom)
+int checkRamWrite(Machine* m,unsigned short addr,unsigned char val)
 {
-	in = rom[counter * 2] & 0xFF;
-	in <<= 8;
-	in |= (rom[counter * 2 + 1] & 0xFF);
+	// RAM may be shared with other cores, see execute()
+	unsigned char old = __atomic_load_n(&m->ram[addr],__ATOMIC_RELAXED);
+	if((m->ramWatch[addr] & RAM_WATCH) && old != val) {
+		cout << "WATCHPOINT - RAM[" << addr << "] changed from "
+			<< (int) old << " to " << (int) val << endl << endl;
+		__atomic_store_n(&m->ram[addr],val,__ATOMIC_RELAXED);
+		__atomic_store_n(&m->ramDirty[addr >> RAM_PAGE_BITS],1,__ATOMIC_RELAXED);
+		return STOP_BREAK;
+	}
+	if((m->ramWatch[addr] & RAM_UNTIL) && m->ramUntil[addr] == val) {
+		cout << "UNTIL - RAM[" << addr << "] is " << (int) val << endl << endl;
+		__atomic_store_n(&m->ram[addr],val,__ATOMIC_RELAXED);
+		__atomic_store_n(&m->ramDirty[addr >> RAM_PAGE_BITS],1,__ATOMIC_RELAXED);
+		return STOP_UNTIL;
+	}
+	return 0;
+}
+
+/*
+ * Checks the cycle budget and, every CLOCK_CHECK basic blocks, the wall clock.
+ *
+ * Returns the reason to stop (one of STOP_*), or 0 to keep running.
+ */
+int checkLimits(Machine* m)
+{
+	if(m->maxCycles && m->cycle > m->maxCycles) {
+		return STOP_CYCLES;
+	}
+	if(m->deadline && !--m->clockCheck) {
+		m->clockCheck = CLOCK_CHECK;
+		if(now() >= m->deadline) {
+			return STOP_TIMEOUT;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns the current monotonic wall clock time in seconds.
+ */
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Records a screen change in the frame stream. When frames are sampled,
+ * changes within frameEvery cycles of the last frame are held back until
+ * the next frame, or the end of the run.
+ */
+void recordFrame(Machine* m)
+{
+	if(m->frameEvery && m->lastFrameCycle && m->cycle - m->lastFrameCycle < m->frameEvery) {
+		m->framePending = 1;
+		return;
+	}
+	writeFrame(m);
+}
+
+/*
+ * Writes the screen to the frame stream as a delta of the last frame:
+ * 	cycles since the last frame, 7 bits per byte, high bit set on all but the last byte
+ * 	2 byte big endian mask of the screen addresses that changed (bit 0 is address 0)
+ * 	1 byte for each changed address, from lowest to highest
+ * Frames without any change are not written.
+ */
+void writeFrame(Machine* m)
+{
+	unsigned char buf[10 + 2 + SCREEN_WIDTH];
+	int len = 0, mask = 0;
+	for(int i=0;i<SCREEN_WIDTH;i++) {
+		if(m->screen[i] != m->lastFrame[i]) {
+			mask |= 1 << i;
+		}
+	}
+	m->framePending = 0;
+	if(!mask) {
+		return;
+	}
+	unsigned long long delta = m->cycle - m->lastFrameCycle;
+	while(delta > 0x7F) {
+		buf[len++] = 0x80 | (delta & 0x7F);
+		delta >>= 7;
+	}
+	buf[len++] = delta;
+	buf[len++] = (mask >> 8) & 0xFF;
+	buf[len++] = mask & 0xFF;
+	for(int i=0;i<SCREEN_WIDTH;i++) {
+		if(mask & (1 << i)) {
+			buf[len++] = m->screen[i];
+			m->lastFrame[i] = m->screen[i];
+		}
+	}
+	fwrite(buf,1,len,m->frames);
+	m->lastFrameCycle = m->cycle;
+}
+
+/*
+ * Writes the screen to path as a 16 x 8 plain PBM image, laid out
+ * the same way printScreen() draws it.
+ *
+ * Returns true if the file was written, otherwise false.
+ */
+bool writePbm(Machine* m,const char* path)
+{
+	FILE* file = fopen(path,"w");
+	if(file == NULL) {
+		return false;
+	}
+	fprintf(file,"P1\n%d 8\n",SCREEN_WIDTH);
+	for(int i=0;i<8;i++) {
+		int mask = 1 << (7 - i);
+		for(int j=SCREEN_WIDTH-1;j>=0;j--) {
+			fprintf(file,(j) ? "%d " : "%d\n",(m->screen[j] & mask) ? 1 : 0);
+		}
+	}
+	return !fclose(file);
+}
+
+/*
+ * Writes a listing of the ROM to path (see disListing()), with the number of
+ * times each instruction was executed and its share of the clock cycles, and
+ * with a debug map, the source file, line and label of each instruction. The
+ * listing ends at the last instruction that isn't zero or was executed.
+ *
+ * Returns true if the listing was written, otherwise false.
+ */
+bool writeProfile(Machine* m,const char* path)
+{
+	static unsigned short code[ROM_SIZE];
+	static char* notes[ROM_SIZE];
+	char text[PATH_MAX + 64];
+	int len = 0;
+	FILE* file = fopen(path,"w");
+	if(file == NULL) {
+		return false;
+	}
+	for(int i=0;i<ROM_SIZE;i++) {
+		// Strip out any breakpoints or other traps patched into the ROM
+		code[i] = m->code[i] & INSTR_MASK;
+		if(code[i] || m->counts[i]) {
+			len = i + 1;
+		}
+	}
+	for(int i=0;i<len;i++) {
+		notes[i] = sourceText(i,text,sizeof(text)) ? strdup(text) : NULL;
+	}
+	disListing(file,code,len,m->counts,notes);
+	for(int i=0;i<len;i++) {
+		free(notes[i]);
+	}
+	return !fclose(file);
+}
+
+/*
+ * Prints why the machine stopped, followed by its final state.
+ */
+void printReport(Machine* m,int stop,int showScreen)
+{
+	cout << "STOPPED: " << stopNames[stop] << endl;
+	cout << "SCREEN CHANGES: " << m->screenChanges << endl;
+	unsigned short pc = m->reg[PROG_COUNTER];
+	printState(m,(pc < ROM_SIZE) ? m->code[pc] : 0,showScreen);
+}
+
+/*
+ * Prints the current clock cycle, counter, instruction and registers.
+ * Also prints the emulated display if showScreen is set.
+ */
+void printState(Machine* m,unsigned int in,int showScreen)
+{
+	// Print emulator information
+	cout << "CLOCK CYCLE: " << m->cycle << endl;
+	cout << "    COUNTER: ";
+	printReg(m->reg[PROG_COUNTER]);
+	printSource(m->reg[PROG_COUNTER]);
+	cout << endl;
+	cout << "INSTRUCTION: ";
+	printReg(in & INSTR_MASK);
+	if(m->reg[PROG_COUNTER] < ROM_SIZE) {
+		cout << " (" << disInstr(in & INSTR_MASK) << ")";
+	}
+	cout << endl << endl;
+	// Print all of the emulator registers
+	cout << "--------------- REGISTERS ---------------" << endl << endl;
+	printAll(m->reg,16);
+	// Print the emulated display if option is allowed
+	if(showScreen) {
+		cout << endl << "---------------- SCREEN -----------------" << endl << endl;
+		printScreen(m->screen,SCREEN_WIDTH);
+	}
 }
 
 /*
@@ -176,16 +1668,17 @@ void loadIn(unsigned short &counter,unsigned short &in, char* rom)
  * 
  * Returns 0 if execution was correct, otherwise returns a non-zero number.
  */
-int processIn(unsigned short* reg,unsigned short in)
+int processIn(unsigned short* reg,unsigned int in)
 {
-	int opcd = ((in & 0xF000) >> 12) & 0xFF;
+	int opcd = (in >> 12) & 0xFFF;
 	int regD = ((in & 0x0F00) >> 8) & 0xFF;
 	int regA = ((in & 0x00F0) >> 4) & 0xFF;
 	int regB = (in & 0x000F) & 0xFF;
 	// Flag variable to determine whether or not to increment the PC
 	int flag = (regD == PROG_COUNTER) ? 0 : 1;
 	
-	if(regD != INPUT) {
+	// Writes to the input register are ignored, unless a trap is patched in
+	if(regD != INPUT || opcd > 15) {
 		switch(opcd) {
 			
 			case 0: // MOVE
@@ -359,3 +1852,58 @@ void printScreen(unsigned char* screen,int len)
 	}
 	cout << endl;
 }
+
+/*
+ * Parses a decimal, hexadecimal (0x) or octal (0) number from str.
+ *
+ * Returns: The number, or -1 if str is not a number between 0 and max
+ */
+int parseNum(const char* str,int max)
+{
+	char* end;
+	long num = strtol(str,&end,0);
+	if(*str == '\0' || *end != '\0' || num < 0 || num > max) {
+		return -1;
+	}
+	return (int) num;
+}
+
+/*
+ * Parses a decimal, hexadecimal (0x) or octal (0) count of up to 64 bits from str into num.
+ *
+ * Returns true if str is a number that isn't negative, otherwise false.
+ */
+bool parseCount(const char* str,unsigned long long* num)
+{
+	char* end;
+	// strtoull() would quietly negate a leading minus sign
+	if(!isdigit((unsigned char) *str)) {
+		return false;
+	}
+	errno = 0;
+	*num = strtoull(str,&end,0);
+	return *end == '\0' && errno == 0;
+}
+
+/*
+ * Parses a register name (r0 - rF, r0 - r15 or pc) from str.
+ *
+ * Returns: The register number, or -1 if str is not a register
+ */
+int parseReg(const char* str)
+{
+	if(!strcasecmp(str,"pc")) {
+		return PROG_COUNTER;
+	}
+	if(str[0] != 'r' && str[0] != 'R') {
+		return -1;
+	}
+	int r = parseNum(&str[1],15);
+	if(r < 0 && str[1] != '\0' && str[2] == '\0') {
+		char c = tolower(str[1]);
+		if(c >= 'a' && c <= 'f') {
+			r = c - 'a' + 10;
+		}
+	}
+	return r;
+}
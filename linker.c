@@ -0,0 +1,327 @@
+/*
+ * CSC 364 Linker
+ * Links object files written by asm16 -c into a single rom for the emulator,
+ * leaving out every section of code that nothing jumps to.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Total number of bytes that can be written
+#define ROM_SIZE 131068
+
+// Object file magic number and flags, see writeObject() in assembler.c
+#define OBJ_MAGIC "O16"
+#define SEC_RUNS_ON 1
+#define SYM_GLOBAL 1
+#define SYM_UNDEFINED 0xFFFF
+
+// A section of machine code, kept in the rom only if it is live
+struct Section {
+	int size, flags;
+	unsigned char *code;
+	int live;
+	int addr;	// Byte address in the rom once laid out
+};
+
+// A label, defined in a section of its object file or in another one
+struct Symbol {
+	char *name;
+	int flags, section, offset;
+};
+
+// A SET / SETH pair at offset in a section, to be filled in with the address of a symbol
+struct Reloc {
+	int section, offset, sym;
+};
+
+struct Object {
+	const char *path;
+	int numSections, numSyms, numRelocs;
+	struct Section *sections;
+	struct Symbol *syms;
+	struct Reloc *relocs;
+};
+
+// Function prototypes
+int readObject(struct Object*,const char*);
+int readNum(unsigned char**,unsigned char*);
+int resolve(int,int,int*,int*);
+void markLive();
+int layout();
+void patch();
+
+// All of the object files being linked, in the order they are laid out
+struct Object *objs = NULL;
+int numObjs = 0;
+unsigned char rom[ROM_SIZE];
+int err = 0;
+
+/*
+ * Main function. Every object file named on the command line is read, the sections
+ * reachable from the start of the first one are laid out in order and the rom is
+ * printed to stdout. Problems are printed to stderr, and no rom is written if there are any.
+ */
+int main(int argc,char **argv)
+{
+	int i;
+	if(argc < 2) {
+		fprintf(stderr,"Usage: link16 main.o16 [more.o16 ...] > output\n");
+		return 1;
+	}
+	objs = calloc(argc - 1,sizeof(struct Object));
+	for(i=1;i<argc;i++) {
+		if(readObject(&objs[numObjs],argv[i])) {
+			fprintf(stderr,"Linker Error: \'%s\' is not a valid object file\n",argv[i]);
+			return 1;
+		}
+		numObjs++;
+	}
+	markLive();
+	int len = err ? 0 : layout();
+	if(!err) {
+		patch();
+	}
+	if(!err) {
+		fprintf(stderr,"Total Bytes Written: %d\n",len);
+		fwrite(rom,sizeof(char),len,stdout);
+	}
+	return err ? 1 : 0;
+}
+
+/*
+ * Reads the object file at path (see writeObject() in assembler.c) into obj.
+ *
+ * Returns: 0 if the file was read, otherwise 1
+ */
+int readObject(struct Object *obj,const char *path)
+{
+	FILE *fp = fopen(path,"rb");
+	if(fp == NULL) {
+		return 1;
+	}
+	fseek(fp,0,SEEK_END);
+	long len = ftell(fp);
+	fseek(fp,0,SEEK_SET);
+	unsigned char *data = malloc(len + 1);
+	if(len < 10 || fread(data,1,len,fp) != (size_t) len || memcmp(data,OBJ_MAGIC,4)) {
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+	unsigned char *p = data + 4, *end = data + len;
+	int i;
+	obj->path = path;
+	obj->numSections = readNum(&p,end);
+	obj->numSyms = readNum(&p,end);
+	obj->numRelocs = readNum(&p,end);
+	obj->sections = calloc(obj->numSections,sizeof(struct Section));
+	obj->syms = calloc(obj->numSyms,sizeof(struct Symbol));
+	obj->relocs = calloc(obj->numRelocs,sizeof(struct Reloc));
+	for(i=0;i<obj->numSections;i++) {
+		obj->sections[i].size = readNum(&p,end);
+		obj->sections[i].flags = readNum(&p,end);
+	}
+	for(i=0;i<obj->numSyms;i++) {
+		struct Symbol *sym = &obj->syms[i];
+		sym->flags = readNum(&p,end);
+		sym->section = readNum(&p,end);
+		sym->offset = readNum(&p,end);
+		int nameLen = readNum(&p,end);
+		if(nameLen < 0 || end - p < nameLen) {
+			return 1;
+		}
+		sym->name = strndup((char*) p,nameLen);
+		p += nameLen;
+		if(sym->section != SYM_UNDEFINED && sym->section >= obj->numSections) {
+			return 1;
+		}
+	}
+	for(i=0;i<obj->numRelocs;i++) {
+		struct Reloc *rel = &obj->relocs[i];
+		rel->section = readNum(&p,end);
+		rel->offset = readNum(&p,end);
+		rel->sym = readNum(&p,end);
+		if(rel->section < 0 || rel->section >= obj->numSections || rel->sym < 0 || rel->sym >= obj->numSyms
+			|| rel->offset + 4 > obj->sections[rel->section].size) {
+			return 1;
+		}
+	}
+	for(i=0;i<obj->numSections;i++) {
+		if(obj->sections[i].size < 0 || end - p < obj->sections[i].size) {
+			return 1;
+		}
+		obj->sections[i].code = p;
+		p += obj->sections[i].size;
+	}
+	return 0;
+}
+
+/*
+ * Reads a 16 bit number, high byte first, and moves p past it.
+ *
+ * Returns: The number, or -1 if the end of the data was reached
+ */
+int readNum(unsigned char **p,unsigned char *end)
+{
+	if(end - *p < 2) {
+		*p = end;
+		return -1;
+	}
+	int num = ((*p)[0] << 8) | (*p)[1];
+	*p += 2;
+	return num;
+}
+
+/*
+ * Finds where symbol sym of object o is defined. Symbols defined in another object
+ * file are looked up by name among the global symbols of every object file.
+ *
+ * Returns: 0 with the object and symbol number of the definition in defObj and
+ * 			defSym, or 1 if it isn't defined
+ */
+int resolve(int o,int sym,int *defObj,int *defSym)
+{
+	struct Symbol *s = &objs[o].syms[sym];
+	int i, j;
+	if(s->section != SYM_UNDEFINED) {
+		*defObj = o;
+		*defSym = sym;
+		return 0;
+	}
+	for(i=0;i<numObjs;i++) {
+		for(j=0;j<objs[i].numSyms;j++) {
+			struct Symbol *t = &objs[i].syms[j];
+			if((t->flags & SYM_GLOBAL) && t->section != SYM_UNDEFINED && !strcmp(t->name,s->name)) {
+				*defObj = i;
+				*defSym = j;
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ * Marks every section reachable from the start of the first object file as live.
+ * A section is reachable if a live section jumps to one of its labels, or if the
+ * section before it is live and runs on into it.
+ * Also reports labels defined by more than one object file.
+ */
+void markLive()
+{
+	int i, j, k, n, top = 0, max = 0;
+	for(i=0;i<numObjs;i++) {
+		max += objs[i].numSections;
+		for(j=0;j<objs[i].numSyms;j++) {
+			struct Symbol *s = &objs[i].syms[j];
+			if(!(s->flags & SYM_GLOBAL) || s->section == SYM_UNDEFINED) {
+				continue;
+			}
+			for(k=0;k<i;k++) {
+				for(n=0;n<objs[k].numSyms;n++) {
+					struct Symbol *t = &objs[k].syms[n];
+					if((t->flags & SYM_GLOBAL) && t->section != SYM_UNDEFINED && !strcmp(t->name,s->name)) {
+						fprintf(stderr,"Linker Error: Label \'%s\' is defined in both \'%s\' and \'%s\'\n",
+							s->name,objs[k].path,objs[i].path);
+						err++;
+					}
+				}
+			}
+		}
+	}
+	// Work list of (object, section) pairs that were just marked live
+	int *stack = malloc(2 * (max + 1) * sizeof(int));
+	if(objs[0].numSections > 0) {
+		objs[0].sections[0].live = 1;
+		stack[top++] = 0;
+		stack[top++] = 0;
+	}
+	while(top > 0) {
+		int sec = stack[--top], o = stack[--top];
+		struct Object *obj = &objs[o];
+		if((obj->sections[sec].flags & SEC_RUNS_ON) && sec + 1 < obj->numSections && !obj->sections[sec + 1].live) {
+			obj->sections[sec + 1].live = 1;
+			stack[top++] = o;
+			stack[top++] = sec + 1;
+		}
+		for(i=0;i<obj->numRelocs;i++) {
+			struct Reloc *rel = &obj->relocs[i];
+			int defObj, defSym;
+			if(rel->section != sec) {
+				continue;
+			}
+			if(resolve(o,rel->sym,&defObj,&defSym)) {
+				fprintf(stderr,"Linker Error: Label \'%s\' used in \'%s\' is not defined\n",obj->syms[rel->sym].name,obj->path);
+				err++;
+				continue;
+			}
+			struct Section *target = &objs[defObj].sections[objs[defObj].syms[defSym].section];
+			if(!target->live) {
+				target->live = 1;
+				stack[top++] = defObj;
+				stack[top++] = objs[defObj].syms[defSym].section;
+			}
+		}
+	}
+	free(stack);
+}
+
+/*
+ * Gives every live section an address, in the order they were given, and copies
+ * its machine code into the rom. Reports how much dead code was left out.
+ *
+ * Returns: The number of bytes in the rom
+ */
+int layout()
+{
+	int i, j, addr = 0, dead = 0, deadBytes = 0;
+	for(i=0;i<numObjs;i++) {
+		for(j=0;j<objs[i].numSections;j++) {
+			struct Section *sec = &objs[i].sections[j];
+			if(!sec->live) {
+				dead++;
+				deadBytes += sec->size;
+				continue;
+			}
+			if(addr + sec->size >= ROM_SIZE) {
+				fprintf(stderr,"Out of Memory Error\n");
+				err++;
+				return 0;
+			}
+			sec->addr = addr;
+			memcpy(&rom[addr],sec->code,sec->size);
+			addr += sec->size;
+		}
+	}
+	fprintf(stderr,"Removed %d unused sections (%d bytes)\n",dead,deadBytes);
+	return addr;
+}
+
+/*
+ * Fills in the target address of every long jump in the live sections.
+ */
+void patch()
+{
+	int i, j;
+	for(i=0;i<numObjs;i++) {
+		for(j=0;j<objs[i].numRelocs;j++) {
+			struct Reloc *rel = &objs[i].relocs[j];
+			struct Section *sec = &objs[i].sections[rel->section];
+			int defObj, defSym;
+			if(!sec->live || resolve(i,rel->sym,&defObj,&defSym)) {
+				continue;
+			}
+			struct Symbol *def = &objs[defObj].syms[defSym];
+			int to = objs[defObj].sections[def->section].addr + def->offset;
+			if(to % 2) {
+				fprintf(stderr,"Linker Error: Label \'%s\' is not on an instruction, check includebin sizes\n",def->name);
+				err++;
+				continue;
+			}
+			rom[sec->addr + rel->offset + 1] = (unsigned char) ((to / 2) & 0xFF);
+			rom[sec->addr + rel->offset + 3] = (unsigned char) (((to / 2) >> 8) & 0xFF);
+		}
+	}
+}
@@ -0,0 +1,14 @@
+# emu16: --cores 3 --quantum 7
+# Every core adds its own count into RAM address x20 with no locking, so the
+# total depends on how the cores are interleaved, which is fixed by the quantum
+	li OUT1, x20
+	li r1, 50
+add:	li OUT0, 0
+	addi r2, IN, 1
+	set OUT0, 0
+	or OUT0, OUT0, r2
+	seth OUT0, x80
+	subi r1, r1, 1
+	jnz add, r1
+	li OUT0, 0
+	includebin lib/bin/HALT
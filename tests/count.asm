@@ -0,0 +1,7 @@
+# Counts down from 1000 in r0 and up in r1, using labels and jumps
+	li r0, 1000
+	li r1, 0
+loop:	subi r0, r0, 1
+	addi r1, r1, 1
+	jnz loop, r0
+	includebin lib/bin/HALT
@@ -0,0 +1,10 @@
+# Never halts, so it is stopped by the cycle limit with a known count in r1
+	li r1, 0
+	li r2, 7
+spin:	addi r1, r1, 1
+	jn neg, r1
+	jmp spin
+neg:	not r1, r1
+	subi r2, r2, 1
+	jnz spin, r2
+	jmp spin
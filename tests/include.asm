@@ -0,0 +1,8 @@
+# Uses the library snippets from source and from pre-assembled binaries
+	li r3, 1234
+	include lib/NEG3
+	li r0, 77
+	includebin lib/bin/NEG0
+	include lib/RESET
+	li r5, x5A5A
+	include lib/HALT
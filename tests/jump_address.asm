@@ -0,0 +1,9 @@
+# asm16: -O
+# Jumps to a ROM address, so the optimizer must leave the dead move in place
+# or jmp 4 would skip set r4, 2
+	set r1, 5
+	move r2, r2
+	jmp 4
+	set r3, 1
+	set r4, 2
+	includebin lib/bin/HALT
@@ -0,0 +1,7 @@
+# A jump to a ROM address can land after any li, so what registers hold can't
+# be followed: r2 must end up 2001, not 1001 from addi r2, r1, 1
+	li r1, 1000
+	jz 5, r0
+	li r1, 2000
+	li r2, 2001
+	includebin lib/bin/HALT
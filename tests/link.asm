@@ -0,0 +1,8 @@
+# Assembled with -c and linked with the routines below. link16 has to drop the
+# unused routine, or double lands two words later and r5 picks up another PC
+# link16: tests/link/routines.asm
+main:
+	set r1, 7
+	jmp double
+done:
+	includebin lib/bin/HALT
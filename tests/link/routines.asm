@@ -0,0 +1,8 @@
+# Routines linked into tests/link.asm, only double is jumped to
+unused:
+	set r2, 99
+	jmp done
+double:
+	move r5, PC
+	add r1, r1, r1
+	jmp done
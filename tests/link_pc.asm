@@ -0,0 +1,9 @@
+# Moving an address into the PC can't be linked, since link16 moves and drops
+# sections, so asm16 -c has to reject it (ASSEMBLY-ERROR is the golden result)
+# link16: tests/link/routines.asm
+main:
+	set r3, 8
+	move PC, r3
+	jmp double
+done:
+	includebin lib/bin/HALT
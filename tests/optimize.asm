@@ -0,0 +1,11 @@
+# asm16: -O
+# The count test with jumps the peephole optimizer can shorten
+	li r0, 300
+	li r1, 0
+loop:	subi r0, r0, 1
+	jmp next
+next:	addi r1, r1, 2
+	jz done, r0
+	jmp loop
+done:	li r2, x4321
+	includebin lib/bin/HALT
@@ -0,0 +1,20 @@
+# Fills RAM addresses x0100 - x04FF (four pages) with the low byte of the
+# address, then reads them back and adds them up in r2
+	li r0, x0100
+	li r3, x0500
+fill:	move OUT1, r0
+	set OUT0, 0
+	or OUT0, OUT0, r0
+	seth OUT0, x80
+	addi r0, r0, 1
+	sub r4, r3, r0
+	jnz fill, r4
+	li OUT0, 0
+	li r0, x0100
+	li r2, 0
+sum:	move OUT1, r0
+	add r2, r2, IN
+	addi r0, r0, 1
+	sub r4, r3, r0
+	jnz sum, r4
+	includebin lib/bin/HALT
@@ -0,0 +1,88 @@
+#!/bin/sh
+# Golden state tests for the assembler and emulator
+# Every program in lib/ and tests/ is assembled and run headless for a fixed number
+# of clock cycles, and the hash of its final registers, RAM, screen and clock cycle
+# (emu16 --hash) is compared with the one recorded in tests/golden. Each rom is also
+# disassembled with dis16 and assembled again, which has to give the same rom.
+# A program can pass extra options with comment lines starting "# asm16:" or "# emu16:".
+# A "# link16:" line names more source files: every file is then assembled with -c and
+# the object files are linked into the rom with link16.
+# The snippets in lib/ are run after tests/prologue.inc, which loads every register.
+#
+#	sh tests/run.sh          : run every test, exits with 1 if any failed
+#	sh tests/run.sh --update : record the current results as the golden values
+
+CYCLES=100000
+cd "$(dirname "$0")/.." || exit 1
+
+# Assemble and run a single program, printing its path and state hash(es)
+if [ "$1" = "--one" ]; then
+	rom=$(mktemp) || exit 1
+	asmArgs=$(sed -n 's/^# asm16: //p' "$2")
+	emuArgs=$(sed -n 's/^# emu16: //p' "$2")
+	linkSrcs=$(sed -n 's/^# link16: //p' "$2")
+	if [ "${2#lib/}" != "$2" ]; then
+		src="$rom.asm"
+		printf 'include tests/prologue.inc\ninclude %s\n' "$2" > "$src"
+	else
+		src=$2
+	fi
+	if [ -n "$linkSrcs" ]; then
+		objs=
+		n=0
+		for file in "$src" $linkSrcs; do
+			n=$((n + 1))
+			./asm16 -c $asmArgs < "$file" > "$rom.$n.o16" 2> /dev/null || objs=failed
+			[ "$objs" = failed ] || objs="$objs $rom.$n.o16"
+		done
+		[ "$objs" != failed ] && ./link16 $objs > "$rom" 2> /dev/null
+	else
+		./asm16 $asmArgs < "$src" > "$rom" 2> /dev/null
+	fi
+	if [ $? -eq 0 ]; then
+		hash=$(./emu16 -f "$rom" -q --max-cycles $CYCLES --hash $emuArgs | sed -n 's/^STATE HASH: //p')
+		if ! ./dis16 < "$rom" | ./asm16 2> /dev/null | cmp -s - "$rom"; then
+			hash="$hash DISASSEMBLY-MISMATCH"
+		fi
+	else
+		hash=ASSEMBLY-ERROR
+	fi
+	rm -f "$rom" "$rom".*
+	echo "$2" $hash
+	exit 0
+fi
+
+# Tests run in parallel, one per processor
+results=$(mktemp) || exit 1
+for file in lib/* tests/*.asm; do
+	if [ -f "$file" ]; then
+		echo "$file"
+	fi
+done | xargs -n 1 -P "$(getconf _NPROCESSORS_ONLN)" sh tests/run.sh --one | sort > "$results"
+
+if [ "$1" = "--update" ]; then
+	mv "$results" tests/golden
+	echo "Recorded $(wc -l < tests/golden) golden states"
+	exit 0
+fi
+
+awk 'NR == FNR { golden[$1] = $0; next }
+	{
+		total++
+		if(!($1 in golden)) {
+			print "NEW: " $1 " (run make golden to record it)"
+			failed++
+		}else if(golden[$1] != $0) {
+			print "FAILED: " $1
+			print "\texpected " substr(golden[$1],length($1) + 2)
+			print "\t     got " substr($0,length($1) + 2)
+			failed++
+		}
+	}
+	END {
+		print "Passed " (total - failed) " of " total " tests"
+		exit failed ? 1 : 0
+	}' tests/golden "$results"
+status=$?
+rm -f "$results"
+exit $status
@@ -0,0 +1,17 @@
+# Draws a diagonal line down the screen, one row at a time
+	li r0, 0
+	li r1, 1
+	li r5, 16
+row:	move OUT1, r0
+	set OUT0, 0
+	or OUT0, OUT0, r1
+	seth OUT0, xC0
+	add r1, r1, r1
+	seth r1, 0
+	jnz skip, r1
+	li r1, 1
+skip:	addi r0, r0, 1
+	sub r4, r5, r0
+	jnz row, r4
+	li OUT0, 0
+	includebin lib/bin/HALT